@@ -2,6 +2,7 @@
 #include "elf.h"
 #include "lib.h"
 #include "kernel.h"
+#include "k-log.h"
 
 // k-loader.c
 //
@@ -17,6 +18,10 @@ extern uint8_t _binary_obj_p_alloctests_start[];
 extern uint8_t _binary_obj_p_alloctests_end[];
 extern uint8_t _binary_obj_p_test_start[];
 extern uint8_t _binary_obj_p_test_end[];
+extern uint8_t _binary_obj_p_bench_start[];
+extern uint8_t _binary_obj_p_bench_end[];
+extern uint8_t _binary_obj_p_rangetest_start[];
+extern uint8_t _binary_obj_p_rangetest_end[];
 
 struct ramimage {
     void* begin;
@@ -25,19 +30,59 @@ struct ramimage {
     { _binary_obj_p_allocator_start, _binary_obj_p_allocator_end },
     { _binary_obj_p_malloc_start, _binary_obj_p_malloc_end },
     { _binary_obj_p_alloctests_start, _binary_obj_p_alloctests_end },
-    { _binary_obj_p_test_start, _binary_obj_p_test_end }
+    { _binary_obj_p_test_start, _binary_obj_p_test_end },
+    { _binary_obj_p_bench_start, _binary_obj_p_bench_end },
+    { _binary_obj_p_rangetest_start, _binary_obj_p_rangetest_end }
 };
 
-static int program_load_segment(proc* p, const elf_program* ph,
-                                const uint8_t* src,
-                                x86_64_pagetable* (*allocator)(void));
+void* page_alloc(int8_t owner);
+void* page_alloc_zeroed(int8_t owner);
+void page_ref(uintptr_t pa);
+int map_zero_page(proc* p, uintptr_t va, int writable);
+
+// Pages of read-only segments are loaded once per program and kept in
+// `text_cache`, owned by the kernel, which holds a reference to each.
+// Later processes running the same program map the cached pages.
+#define TEXT_CACHE_SIZE 64
+
+static struct text_page {
+    int programnumber;
+    uintptr_t va;
+    uintptr_t pa;                       // 0 if this slot is unused
+} text_cache[TEXT_CACHE_SIZE];
+
+// With `program_load_lazy` set (boot option `load=lazy`), program_load()
+// only records each process's segments in `load_segments`, and
+// program_load_fault() fills in pages on first touch.
+#define NLOADSEGMENTS 8
+
+typedef struct load_segment {
+    int programnumber;                  // -1 if this slot is unused
+    uintptr_t va;                       // ph->p_va
+    uintptr_t end_file;                 // va + ph->p_filesz
+    uintptr_t end_mem;                  // va + ph->p_memsz
+    const uint8_t* src;                 // file data for `va`
+    int writable;
+} load_segment;
+
+int program_load_lazy;
+static load_segment load_segments[NPROC][NLOADSEGMENTS];
+
+static int program_load_segment(proc* p, const load_segment* seg,
+                                int lazy);
+static int program_load_text_page(proc* p, const load_segment* seg,
+                                  uintptr_t addr);
+static int program_load_data_page(proc* p, const load_segment* seg,
+                                  uintptr_t addr);
+static int program_load_data(proc* p, const load_segment* seg);
+static int program_load_fail(proc* p, uintptr_t addr);
 
 // program_load(p, programnumber)
 //    Load the code corresponding to program `programnumber` into the process
 //    `p` and set `p->p_registers.reg_rip` to its entry point. Calls
 //    `assign_physical_page` to as required. Returns 0 on success and
-//    -1 on failure (e.g. out-of-memory). `allocator` is passed to
-//    `virtual_memory_map`.
+//    -1 on failure (e.g. out-of-memory). `allocator` is unused:
+//    `virtual_memory_map` allocates its own page tables.
 
 int program_load(proc* p, int programnumber,
                  x86_64_pagetable* (*allocator)(void)) {
@@ -49,12 +94,32 @@ int program_load(proc* p, int programnumber,
 
     // load each loadable program segment into memory
     elf_program* ph = (elf_program*) ((const uint8_t*) eh + eh->e_phoff);
+    int nloads = 0;
+    for (int i = 0; i < eh->e_phnum; ++i) {
+        nloads += ph[i].p_type == ELF_PTYPE_LOAD;
+    }
+    int lazy = program_load_lazy && nloads <= NLOADSEGMENTS;
+
+    load_segment* seg = load_segments[p->p_pid];
+    for (int i = 0; i < NLOADSEGMENTS; ++i) {
+        seg[i].programnumber = -1;
+    }
     for (int i = 0; i < eh->e_phnum; ++i) {
         if (ph[i].p_type == ELF_PTYPE_LOAD) {
-            const uint8_t* pdata = (const uint8_t*) eh + ph[i].p_offset;
-            if (program_load_segment(p, &ph[i], pdata, allocator) < 0) {
+            seg->programnumber = programnumber;
+            seg->va = (uintptr_t) ph[i].p_va;
+            seg->end_file = seg->va + ph[i].p_filesz;
+            seg->end_mem = seg->va + ph[i].p_memsz;
+            seg->src = (const uint8_t*) eh + ph[i].p_offset;
+            seg->writable = (ph[i].p_flags & ELF_PFLAG_WRITE) != 0;
+            if (program_load_segment(p, seg, lazy) < 0) {
                 return -1;
             }
+            if (lazy) {
+                ++seg;
+            } else {
+                seg->programnumber = -1;
+            }
         }
     }
 
@@ -64,53 +129,30 @@ int program_load(proc* p, int programnumber,
 }
 
 
-// program_load_segment(p, ph, src, allocator)
-//    Load an ELF segment at virtual address `ph->p_va` in process `p`. Copies
-//    `[src, src + ph->p_filesz)` to `dst`, then clears
-//    `[ph->p_va + ph->p_filesz, ph->p_va + ph->p_memsz)` to 0.
-//    Calls `assign_physical_page` to allocate pages and `virtual_memory_map`
-//    to map them in `p->p_pagetable`. Returns 0 on success and -1 on failure.
-
-static int program_load_segment(proc* p, const elf_program* ph,
-                                const uint8_t* src,
-                                x86_64_pagetable* (*allocator)(void)) {
-    uintptr_t va = (uintptr_t) ph->p_va;
-    uintptr_t end_file = va + ph->p_filesz, end_mem = va + ph->p_memsz;
-    va &= ~(PAGESIZE - 1);                // round to page boundary
-
-
-    // allocate memory
-    for (uintptr_t addr = va; addr < end_mem; addr += PAGESIZE) {
-        uintptr_t pa = (uintptr_t)palloc(p->p_pid);
-        if(pa == (uintptr_t)NULL || virtual_memory_map(p->p_pagetable, addr, pa, PAGESIZE,
-                    PTE_W | PTE_P | PTE_U) < 0) {
-            console_printf(CPOS(22, 0), 0xC000,
-                    "program_load_segment(pid %d): can't assign address %p\n", p->p_pid, addr);
-            return -1;
-        }
-    }
-
-    // ensure new memory mappings are active
-    set_pagetable(p->p_pagetable);
-
-    // copy data from executable image into process memory
-    memcpy((uint8_t*) va, src, end_file - va);
-    memset((uint8_t*) end_file, 0, end_mem - end_file);
-
-    // restore kernel pagetable
-    set_pagetable(kernel_pagetable);
-
-
-    if((ph->p_flags & ELF_PFLAG_WRITE) == 0) {
-        for (uintptr_t addr = va; addr < end_mem; addr += PAGESIZE) {
-            vamapping mapping = virtual_memory_lookup(p->p_pagetable, addr);
+// program_load_segment(p, seg, lazy)
+//    Load an ELF segment at virtual address `seg->va` in process `p`. Copies
+//    `[seg->src, seg->src + filesz)` to `seg->va`, then clears
+//    `[seg->end_file, seg->end_mem)` to 0. If `lazy`, nothing is mapped
+//    yet; program_load_fault() loads each page when it is first touched.
+//    Returns 0 on success and -1 on failure.
 
-            virtual_memory_map(p->p_pagetable, addr, mapping.pa, PAGESIZE,
-                    PTE_P | PTE_U);
+static int program_load_segment(proc* p, const load_segment* seg,
+                                int lazy) {
+    if (lazy) {
+        // pages are loaded by program_load_fault()
+    } else if (!seg->writable) {
+        for (uintptr_t addr = ROUNDDOWN(seg->va, PAGESIZE);
+             addr < seg->end_mem; addr += PAGESIZE) {
+            if (program_load_text_page(p, seg, addr) < 0) {
+                return program_load_fail(p, addr);
+            }
         }
+    } else if (program_load_data(p, seg) < 0) {
+        return -1;
     }
+
     // TODO : Add code here
-    uintptr_t segment_end = ph->p_va + ph->p_memsz;
+    uintptr_t segment_end = seg->end_mem;
 
     // Step 2: Compare with the current highest break value
     if (segment_end > p->program_break) {
@@ -119,7 +161,181 @@ static int program_load_segment(proc* p, const elf_program* ph,
         p->original_break = p->program_break;  // Initialize the original break as well
     }
     
-    log_printf("Segment end: %p, New program break: %p\n", segment_end, p->program_break);
+    klog(KLOG_DEBUG, "Segment end: %p, New program break: %p\n", segment_end, p->program_break);
     //always just gets rounded  up so that its a multiple of 4k, so roundup is right 
     return 0;
 }
+
+
+// program_load_data(p, seg)
+//    Load the writable segment `seg` into `p` page by page. Returns 0 on
+//    success and -1 on failure.
+
+static int program_load_data(proc* p, const load_segment* seg) {
+    for (uintptr_t addr = ROUNDDOWN(seg->va, PAGESIZE); addr < seg->end_mem;
+         addr += PAGESIZE) {
+        if (program_load_data_page(p, seg, addr) < 0) {
+            return program_load_fail(p, addr);
+        }
+    }
+    return 0;
+}
+
+
+// copy_quads(dst, src, n), zero_quads(dst, n)
+//    Copy or clear `n` 8-byte words with a single string instruction.
+
+static inline void copy_quads(void* dst, const void* src, size_t n) {
+    asm volatile("rep movsq" : "+D" (dst), "+S" (src), "+c" (n)
+                 : : "memory");
+}
+
+static inline void zero_quads(void* dst, size_t n) {
+    asm volatile("rep stosq" : "+D" (dst), "+c" (n)
+                 : "a" (0) : "memory");
+}
+
+// program_load_copy_page(seg, addr, pa)
+//    Fill the physical page `pa`, which backs virtual page `addr` of
+//    segment `seg`, with its file data and zeros, through the kernel's
+//    identity map, so loading never switches page tables.
+
+static void program_load_copy_page(const load_segment* seg, uintptr_t addr,
+                                   uintptr_t pa) {
+    uintptr_t from = addr < seg->va ? seg->va : addr;
+    uintptr_t to = addr + PAGESIZE < seg->end_file
+        ? addr + PAGESIZE : seg->end_file;
+    if (from == addr && to == addr + PAGESIZE) {
+        copy_quads((void*) pa, seg->src + (addr - seg->va), PAGESIZE / 8);
+        return;
+    }
+    // only the first and last pages of a segment get here
+    zero_quads((void*) pa, PAGESIZE / 8);
+    if (from < to) {
+        memcpy((void*) (pa + (from - addr)), seg->src + (from - seg->va),
+               to - from);
+    }
+}
+
+// program_load_text_page(p, seg, addr)
+//    Map page `addr` of the read-only segment `seg` into `p`. A page that
+//    lies entirely within the file data and is page-aligned in the
+//    ramimage is mapped straight from the image. Otherwise the page comes
+//    from `text_cache`, or is loaded (and cached, if there is room).
+//    Returns 0 on success and -1 on failure.
+
+static int program_load_text_page(proc* p, const load_segment* seg,
+                                  uintptr_t addr) {
+    const uint8_t* image = seg->src + (addr - seg->va);
+    if (addr >= seg->va && addr + PAGESIZE <= seg->end_file
+        && ((uintptr_t) image & (PAGESIZE - 1)) == 0) {
+        if (virtual_memory_map(p->p_pagetable, addr, (uintptr_t) image,
+                               PAGESIZE, PTE_P | PTE_U) < 0) {
+            return -1;
+        }
+        page_ref((uintptr_t) image);
+        return 0;
+    }
+
+    struct text_page* tp = NULL;
+    struct text_page* free_slot = NULL;
+    for (int i = 0; i < TEXT_CACHE_SIZE && !tp; ++i) {
+        if (text_cache[i].pa && text_cache[i].programnumber == seg->programnumber
+            && text_cache[i].va == addr) {
+            tp = &text_cache[i];
+        } else if (!text_cache[i].pa && !free_slot) {
+            free_slot = &text_cache[i];
+        }
+    }
+
+    uintptr_t pa;
+    if (tp) {
+        pa = tp->pa;
+    } else {
+        pa = (uintptr_t) page_alloc(p->p_pid);
+        if (!pa) {
+            return -1;
+        }
+        program_load_copy_page(seg, addr, pa);
+        if (free_slot) {
+            free_slot->programnumber = seg->programnumber;
+            free_slot->va = addr;
+            free_slot->pa = pa;
+            pageinfo[PAGENUMBER(pa)].owner = PO_KERNEL;
+            tp = free_slot;
+        }
+    }
+
+    if (virtual_memory_map(p->p_pagetable, addr, pa, PAGESIZE,
+                           PTE_P | PTE_U) < 0) {
+        if (!tp) {
+            freepage(pa);
+        }
+        return -1;
+    }
+    if (tp) {
+        page_ref(pa);
+    }
+    return 0;
+}
+
+// program_load_data_page(p, seg, addr)
+//    Map page `addr` of the writable segment `seg` into `p`: the shared
+//    zero page if it holds only BSS, otherwise a fresh copy. Returns 0 on
+//    success and -1 on failure.
+
+static int program_load_data_page(proc* p, const load_segment* seg,
+                                  uintptr_t addr) {
+    if (addr >= seg->end_file) {
+        return map_zero_page(p, addr, 1);
+    }
+    uintptr_t pa = (uintptr_t) page_alloc(p->p_pid);
+    if (!pa) {
+        return -1;
+    }
+    program_load_copy_page(seg, addr, pa);
+    if (virtual_memory_map(p->p_pagetable, addr, pa, PAGESIZE,
+                           PTE_P | PTE_W | PTE_U) < 0) {
+        freepage(pa);
+        return -1;
+    }
+    return 0;
+}
+
+// program_load_fault(p, va)
+//    Load the page containing `va` if it belongs to a segment of `p` that
+//    was loaded lazily. Returns 0 if the page is now mapped, -1 if `va` is
+//    not in such a segment, and -2 if out of memory.
+
+int program_load_fault(proc* p, uintptr_t va) {
+    const load_segment* seg = load_segments[p->p_pid];
+    for (int i = 0; i < NLOADSEGMENTS; ++i, ++seg) {
+        if (seg->programnumber >= 0
+            && va >= ROUNDDOWN(seg->va, PAGESIZE)
+            && va < ROUNDUP(seg->end_mem, PAGESIZE)) {
+            uintptr_t addr = ROUNDDOWN(va, PAGESIZE);
+            int r = seg->writable ? program_load_data_page(p, seg, addr)
+                : program_load_text_page(p, seg, addr);
+            return r < 0 ? -2 : 0;
+        }
+    }
+    return -1;
+}
+
+// program_load_fork(parent, child)
+//    Give process `child` the lazily loaded segments of `parent`.
+
+void program_load_fork(pid_t parent, pid_t child) {
+    memcpy(load_segments[child], load_segments[parent],
+           sizeof(load_segments[child]));
+}
+
+// program_load_fail(p, addr)
+//    Report that address `addr` of process `p` could not be loaded.
+//    Returns -1.
+
+static int program_load_fail(proc* p, uintptr_t addr) {
+    console_printf(CPOS(22, 0), 0xC000,
+            "program_load_segment(pid %d): can't assign address %p\n", p->p_pid, addr);
+    return -1;
+}
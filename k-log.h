@@ -0,0 +1,45 @@
+#ifndef WEENSYOS_K_LOG_H
+#define WEENSYOS_K_LOG_H
+#include "kernel.h"
+
+// KERNEL LOG
+//
+//    klog(level, ...) appends a message to the in-memory ring in kernel.c
+//    instead of writing it to the host's `log.txt` right away. Levels
+//    above KLOG_LEVEL are compiled out, and levels above `klog_level`
+//    (boot option `log=error|warn|info|debug`) are skipped before any
+//    formatting. klog_flush() hands the buffered text to log_printf() in
+//    large chunks; it runs when the ring is half full, when the CPU goes
+//    idle, and on every kernel_panic() or failed assert() in a file that
+//    includes this header.
+
+#define KLOG_ERROR 0
+#define KLOG_WARN  1
+#define KLOG_INFO  2
+#define KLOG_DEBUG 3
+#ifndef KLOG_LEVEL
+#define KLOG_LEVEL KLOG_DEBUG
+#endif
+
+extern int klog_level;
+
+#define klog(level, ...) do {                                   \
+        if ((level) <= KLOG_LEVEL && (level) <= klog_level) {   \
+            klog_printf((level), __VA_ARGS__);                  \
+        }                                                       \
+    } while (0)
+
+void klog_printf(int level, const char* format, ...);
+void klog_flush(void);
+
+// Flush the ring before the machine stops.
+#define kernel_panic(...) (klog_flush(), (kernel_panic)(__VA_ARGS__))
+#undef assert
+#define assert(x) do {                                          \
+        if (!(x)) {                                             \
+            klog_flush();                                       \
+            assert_fail(__FILE__, __LINE__, #x);                \
+        }                                                       \
+    } while (0)
+
+#endif
@@ -1,5 +1,7 @@
 #include "kernel.h"
 #include "lib.h"
+#include "k-log.h"
+#include "syscall.h"
 //#include <cstdio>
 
 // kernel.c
@@ -27,15 +29,130 @@ proc processes[NPROC];          // array of process descriptors
 proc* current;                  // pointer to currently executing proc
 
 #define HZ 100                  // timer interrupt frequency (interrupts/sec)
-static unsigned ticks;          // # timer interrupts so far
+static unsigned ticks;          // # timer interrupts so far, in 1/HZ sec
+
+// With TICKLESS set, the timer only runs at HZ while processes compete for
+// the CPU. A lone runnable process, or an idle machine, gets TICKLESS_HZ
+// interrupts a second: enough for scheduler housekeeping and for polling
+// the keyboard. Each interrupt then counts as HZ / timer_hz ticks.
+#ifndef TICKLESS
+#define TICKLESS 0
+#endif
+#define TICKLESS_HZ 10
+static unsigned timer_hz = HZ;
+
+static volatile int idle_active;        // set while schedule() halts
+
+// KERNEL LOG
+//
+//    The ring behind klog() (see k-log.h).
+
+#define KLOG_BUFSIZE 4096               // must be a power of 2
+
+int klog_level = KLOG_INFO;
+static char klog_buf[KLOG_BUFSIZE];
+static unsigned klog_head;              // total bytes ever appended
+static unsigned klog_tail;              // total bytes ever flushed
 
 void schedule(void);
 void run(proc* p) __attribute__((noreturn));
 
 static uint8_t disp_global = 1;         // global flag to display memviewer
 
+// PERFORMANCE COUNTERS
+//
+//    `perf_global` counts events for the whole system and `perf_proc[pid]`
+//    for each process; sys_perf() copies either one out to user space.
+//    Cycle counts come from rdtsc. Exception time runs from the entry to
+//    exception() until the kernel returns to user mode or halts, and is
+//    charged to the process that trapped. Pages allocated to a process
+//    from the pre-zeroed pool count for that process only, since the pool
+//    already counted them globally. The counter layout is in syscall.h.
+
+static perf_counters perf_global;
+static perf_counters perf_proc[NPROC];
+static uint64_t perf_entry_tsc;         // 0 if not inside exception()
+static pid_t perf_entry_pid;            // process that trapped
+static pid_t perf_last_run;             // last process run()
+
+static void perf_exception_done(void);
+
+// FAULT-AROUND
+//
+//    A heap fault normally maps a single page. A process that enables
+//    fault-around with sys_faultaround(n) gets up to `n` pages per fault,
+//    clipped to its break. The window starts at one page and doubles each
+//    time a fault lands right where the previous window ended (sequential
+//    access); any other fault resets it.
+
+#define FAULT_AROUND_MAX 64
+static unsigned fault_around[NPROC];    // max pages per fault; 0 = off
+static unsigned fault_window[NPROC];    // pages mapped at the last fault
+static uintptr_t fault_next[NPROC];     // address just past that window
+
+// LAZY RANGES
+//
+//    sys_page_alloc_range() with PAGE_RANGE_LAZY maps nothing up front; it
+//    records the range, and page faults inside it are served like heap
+//    faults (including fault-around).
+
+#define NLAZYRANGES 8
+
+typedef struct lazy_range {
+    uintptr_t start;
+    uintptr_t end;                      // 0 if this slot is unused
+    int perm;
+} lazy_range;
+
+static lazy_range lazy_ranges[NPROC][NLAZYRANGES];
+
+// SCHEDULER
+//
+//    Runnable processes wait in one of NPRIO run queues (a multi-level
+//    feedback queue); queue 0 has the highest priority. Each CPU has its own
+//    set of queues in its `cpu_state`, and a process is queued on the CPU in
+//    `sched_cpu[pid]`, the one it last ran on. schedule() runs the head of
+//    this CPU's highest nonempty queue, found in O(1) from `runq_mask`, and
+//    steals the best process queued on another CPU if its own are empty. A
+//    process that uses up `sched_allotment[level]` timer ticks drops one
+//    level; one that yields moves up one level, but never above its base
+//    priority. Every SCHED_BOOST_TICKS all processes return to their base
+//    priority so nothing starves. The running process is in no queue.
+//    Queues are linked through `runq_next[pid]`/`runq_prev[pid]`; pid 0 is
+//    never used, so 0 means "none".
+
+#define NPRIO 4
+#define SCHED_BOOST_TICKS HZ
+
+static pid_t runq_next[NPROC];
+static pid_t runq_prev[NPROC];
+static uint8_t runq_queued[NPROC];
+
+static int8_t sched_cpu[NPROC];         // CPU whose queues hold each process
+
+static int8_t sched_prio[NPROC];        // current level of each process
+static int8_t sched_base_prio[NPROC];   // level set by sys_setpriority
+static unsigned sched_used[NPROC];      // ticks used at the current level
+static unsigned sched_last_boost;
+static const unsigned sched_allotment[NPRIO] = { 1, 2, 4, 8 };
+
 #define PAGE_NUMBER_INVALID ((uintptr_t)-1)
 
+// PTE_COW marks a user page shared copy-on-write after fork. It uses one of
+// the page table entry bits the processor ignores.
+#define PTE_COW 0x200
+
+// PAGE TABLE WALKS
+//
+//    Code that sweeps an address range walks down to the page directory
+//    entry once per PDE_SPAN, the 2 MiB one level-4 page table maps, with
+//    pde_lookup(), then reads each page's entry with pde_leaf().
+
+#define PDE_SPAN (PAGESIZE * NPAGETABLEENTRIES)
+
+static x86_64_pageentry_t* pde_lookup(x86_64_pagetable* pt, uintptr_t va);
+static x86_64_pageentry_t pde_leaf(x86_64_pageentry_t* pde, uintptr_t va);
+
 // PAGEINFO
 //
 //    The pageinfo[] array keeps track of information about each physical page.
@@ -52,7 +169,8 @@ static uint8_t disp_global = 1;         // global flag to display memviewer
 //      PO_KERNEL means the kernel, PO_RESERVED means reserved memory (such
 //      as the console), and a number >=0 means that process ID.
 //
-//    pageinfo_init() sets up the initial pageinfo[] state.
+//    pageinfo_init() sets up the initial pageinfo[] state and the free page
+//    lists (see PAGE ALLOCATOR below).
 
 physical_pageinfo pageinfo[PAGENUMBER(MEMSIZE_PHYSICAL)];
 
@@ -64,28 +182,223 @@ typedef enum pageowner {
 
 static void pageinfo_init(void);
 
+// PAGE ALLOCATOR
+//
+//    Free physical pages are kept by a buddy allocator built on pageinfo[].
+//    A free block of 2^order pages starting at page `pn` is linked into
+//    list `buddy_head[order]` through `buddy_next[pn]`/`buddy_prev[pn]`,
+//    and `buddy_order[pn]` records its order (-1 if `pn` starts no listed
+//    block). page_alloc() pops a single page in O(1); page_alloc_order()
+//    returns physically contiguous, naturally aligned runs. Freed pages
+//    merge with their buddies.
+//
+//    Code outside this file may still claim pages straight out of
+//    pageinfo[] (via palloc()), so a listed block is only a hint: it is
+//    checked against the refcounts when allocated, and a block that turns
+//    out to be partly in use is split and its halves retried.
+
+#define BUDDY_MAX_ORDER 9
+static int buddy_head[BUDDY_MAX_ORDER + 1];
+static int buddy_next[NPAGES];
+static int buddy_prev[NPAGES];
+static int8_t buddy_order[NPAGES];
+
+static void buddy_init(void);
+void* page_alloc(int8_t owner);
+void* page_alloc_zeroed(int8_t owner);
+void* page_alloc_order(int8_t owner, int order);
+void page_free_order(uintptr_t pa, int order);
+
+// SMP
+//
+//    Groundwork for more than one CPU. Only the boot CPU runs: starting the
+//    others needs local APIC and trampoline support that is not in this
+//    tree, so NCPU is 1 and this_cpu() is always `cpus[0]`. `current` is a
+//    plain global for the same reason. What is here holds on one CPU and is
+//    laid out so that more CPUs only need to fill in this_cpu():
+//
+//    - Each CPU has its own run queues. They are guarded by its
+//      `runq_lock`, since runq_pick() steals from other CPUs' queues once
+//      its own are empty.
+//    - Each CPU records the page table run() loaded, which tlb_shootdown()
+//      checks to find CPUs that may hold stale translations.
+//    - Every change to a page refcount takes `page_lock`: page_alloc(),
+//      assign_physical_page(), page_ref() and freepage(). So do the buddy
+//      lists. The one exception is pageinfo_init(), which runs before
+//      anything else.
+//    - Each CPU keeps a small cache of pages it freed recently. freepage()
+//      pushes to it, and page_alloc() pops from it without touching the
+//      buddy lists, which only see a batch of pages when a cache fills up
+//      or a contiguous allocation needs them. Like buddy listings, cached
+//      pages are hints, claimed with an atomic compare-and-swap on their
+//      refcount.
+
+#ifndef NCPU
+#define NCPU 1
+#endif
+#define PCP_MAX 32                      // pages per CPU page cache
+#define PCP_BATCH 16                    // pages drained at once
+
+typedef struct spinlock {
+    volatile int locked;
+} spinlock;
+
+typedef struct cpu_state {
+    x86_64_pagetable* pagetable;        // page table loaded by run()
+    spinlock runq_lock;
+    pid_t runq_head[NPRIO];
+    pid_t runq_tail[NPRIO];
+    unsigned runq_mask;                 // bit `level` set if queue nonempty
+    int pcp_count;                      // pages in `pcp`
+    int pcp[PCP_MAX];                   // page numbers of cached free pages
+} cpu_state;
+
+static cpu_state cpus[NCPU];
+static spinlock page_lock;
+
+static inline void spinlock_lock(spinlock* lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (lock->locked) {
+            asm volatile("pause");
+        }
+    }
+}
+
+static inline void spinlock_unlock(spinlock* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline cpu_state* this_cpu(void) {
+    return &cpus[0];
+}
+
+static void pcp_drain(cpu_state* cpu, int npages);
+
+// ZERO PAGE
+//
+//    Reads of untouched heap (and BSS) pages map the shared, kernel-owned
+//    `zero_page` read-only with PTE_COW, so the first write allocates a
+//    real page through process_cow_fault(). A process with fault-around on
+//    gets real pages for heap reads instead, so a sequential scan still
+//    takes one fault per window rather than two per page. The zero page is
+//    pinned: it holds a single reference for good, its mappings are not
+//    counted (they would overflow the 8-bit refcount), freepage() ignores
+//    it, and a write to it is always copied.
+//
+//    While the CPU is idle, schedule() fills `zero_pool` with pre-zeroed
+//    pages, so page_alloc_zeroed() can usually skip the memset.
+//    page_alloc() takes pages back from the pool when memory runs out, but
+//    palloc() callers outside this file cannot. So the pool only grows
+//    while more than ZERO_POOL_RESERVE pages are free otherwise, and the
+//    next idle period gives pages back once free memory drops below that.
+
+#define ZERO_POOL_MAX (NPAGES / 32)
+#define ZERO_POOL_RESERVE (NPAGES / 16)
+static uintptr_t zero_page;
+static uintptr_t zero_pool[ZERO_POOL_MAX];
+static int zero_pool_count;
+
+static void zero_page_init(void);
+static void zero_pool_fill(void);
+int map_zero_page(proc* p, uintptr_t va, int writable);
+
 // array of colors for processes
 static const uint16_t memstate_colors[];
 
 // Memory functions
 
 void check_virtual_memory(void);
+
+// VM CHECKING
+//
+//    check_virtual_memory() walks every page table and all of pageinfo[],
+//    which is too slow to run on every trap outside of debugging. The
+//    boot command option `check=MODE` (or `-DVMCHECK=...` at build time)
+//    picks how often it runs:
+//
+//      full     on every trap (the original behavior)
+//      sampled  on every VMCHECK_INTERVAL-th trap
+//      dirty    after each trap that may have changed memory, checking only
+//               the processes touched since the last check (the default)
+//      off      never
+
+#define VMCHECK_OFF     0
+#define VMCHECK_SAMPLED 1
+#define VMCHECK_DIRTY   2
+#define VMCHECK_FULL    3
+#ifndef VMCHECK
+#define VMCHECK VMCHECK_DIRTY
+#endif
+#define VMCHECK_INTERVAL HZ
+
+static int vmcheck_mode = VMCHECK;
+static unsigned vmcheck_traps;          // traps since the last sampled check
+static uint8_t vm_dirty[NPROC];         // process touched since last check
+static int vm_any_dirty = 1;
+
+static void vm_touch(pid_t pid);
+static void check_virtual_memory_periodic(int intno);
+static int command_word(const char* command, const char* word);
+static const char* command_option(const char* command, const char* name);
+
+// Demand-paged program loading, in k-loader.c
+extern int program_load_lazy;
+int program_load_fault(proc* p, uintptr_t va);
+void program_load_fork(pid_t parent, pid_t child);
 void memshow_physical(void);
 void memshow_virtual(x86_64_pagetable* pagetable, const char* name);
 void memshow_virtual_animate(void);
 
+// The memory viewer redraws at most MEMSHOW_FPS times a second, and only
+// rewrites console cells whose contents changed since they were drawn.
+#define MEMSHOW_FPS 20
+static unsigned memshow_last_frame;
+static int memshow_redraw = 1;          // next frame redraws everything
+static uint16_t memshow_phys_cells[NPAGES];
+static uint16_t memshow_virt_cells[PAGENUMBER(MEMSIZE_VIRTUAL)];
+
+static int memshow_frame_due(void);
+
 static void process_setup(pid_t pid, int program_number);
 
 // kernel(command)
 //    Initialize the hardware and processes and start running. The `command`
 //    string is an optional string passed from the boot loader.
 
+static void runq_push(pid_t pid);
+static void sched_set_prio(pid_t pid, int prio);
+static void schedule_next(pid_t skip);
+
 void kernel(const char* command) {
     hardware_init();
     pageinfo_init();
+    zero_page_init();
     console_clear();
     timer_init(HZ);
 
+    const char* check = command_option(command, "check=");
+    if (check && command_word(check, "off")) {
+        vmcheck_mode = VMCHECK_OFF;
+    } else if (check && command_word(check, "sampled")) {
+        vmcheck_mode = VMCHECK_SAMPLED;
+    } else if (check && command_word(check, "dirty")) {
+        vmcheck_mode = VMCHECK_DIRTY;
+    } else if (check && command_word(check, "full")) {
+        vmcheck_mode = VMCHECK_FULL;
+    }
+    const char* logopt = command_option(command, "log=");
+    if (logopt && command_word(logopt, "error")) {
+        klog_level = KLOG_ERROR;
+    } else if (logopt && command_word(logopt, "warn")) {
+        klog_level = KLOG_WARN;
+    } else if (logopt && command_word(logopt, "info")) {
+        klog_level = KLOG_INFO;
+    } else if (logopt && command_word(logopt, "debug")) {
+        klog_level = KLOG_DEBUG;
+    }
+    const char* load = command_option(command, "load=");
+    program_load_lazy = load && command_word(load, "lazy");
+
     // Set up process descriptors
     memset(processes, 0, sizeof(processes));
     for (pid_t i = 0; i < NPROC; i++) {
@@ -93,16 +406,20 @@ void kernel(const char* command) {
         processes[i].p_state = P_FREE;
     }
 
-    if (command && strcmp(command, "malloc") == 0) {
+    if (command_word(command, "malloc")) {
         process_setup(1, 1);
-    } else if (command && strcmp(command, "alloctests") == 0) {
+    } else if (command_word(command, "alloctests")) {
         process_setup(1, 2);
-    } else if (command && strcmp(command, "test") == 0){
+    } else if (command_word(command, "test")){
         process_setup(1, 3);
-    } else if (command && strcmp(command, "test2") == 0) {
+    } else if (command_word(command, "test2")) {
         for (pid_t i = 1; i <= 2; ++i) {
             process_setup(i, 3);
         }
+    } else if (command_word(command, "bench")) {
+        process_setup(1, 4);
+    } else if (command_word(command, "rangetest")) {
+        process_setup(1, 5);
     } else {
         process_setup(1, 0);
     }
@@ -127,8 +444,340 @@ void process_setup(pid_t pid, int program_number) {
     process_setup_stack(&processes[pid]);
 
     processes[pid].p_state = P_RUNNABLE;
+    vm_touch(pid);
+    memset(&perf_proc[pid], 0, sizeof(perf_proc[pid]));
+    fault_around[pid] = 0;
+    fault_next[pid] = 0;
+    memset(lazy_ranges[pid], 0, sizeof(lazy_ranges[pid]));
+    sched_base_prio[pid] = 0;
+    sched_cpu[pid] = this_cpu() - cpus;
+    sched_set_prio(pid, 0);
+    runq_push(pid);
+}
+
+
+static void buddy_unlink(int pn);
+
+// buddy_push(pn, order), buddy_unlink(pn)
+//    Add the free block of 2^`order` pages at `pn` to its list, or take
+//    the block at `pn` off whichever list holds it.
+
+static void buddy_push(int pn, int order) {
+    if (buddy_order[pn] >= order) {
+        return;                 // already listed as part of a larger block
+    } else if (buddy_order[pn] >= 0) {
+        buddy_unlink(pn);
+    }
+    buddy_order[pn] = order;
+    buddy_prev[pn] = -1;
+    buddy_next[pn] = buddy_head[order];
+    if (buddy_head[order] >= 0) {
+        buddy_prev[buddy_head[order]] = pn;
+    }
+    buddy_head[order] = pn;
+}
+
+static void buddy_unlink(int pn) {
+    int order = buddy_order[pn];
+    if (buddy_prev[pn] >= 0) {
+        buddy_next[buddy_prev[pn]] = buddy_next[pn];
+    } else {
+        buddy_head[order] = buddy_next[pn];
+    }
+    if (buddy_next[pn] >= 0) {
+        buddy_prev[buddy_next[pn]] = buddy_prev[pn];
+    }
+    buddy_order[pn] = -1;
+}
+
+// buddy_release(pn, order)
+//    Return the block of 2^`order` pages at `pn` to the free lists,
+//    merging it with its buddy for as long as the buddy is free too.
+
+static void buddy_release(int pn, int order) {
+    if (buddy_order[pn] >= order) {
+        return;                 // a stale listing already covers it
+    } else if (buddy_order[pn] >= 0) {
+        buddy_unlink(pn);
+    }
+    while (order < BUDDY_MAX_ORDER) {
+        int buddy = pn ^ (1 << order);
+        if (buddy + (1 << order) > NPAGES || buddy_order[buddy] != order) {
+            break;
+        }
+        buddy_unlink(buddy);
+        pn &= ~(1 << order);
+        ++order;
+    }
+    buddy_push(pn, order);
+}
+
+// buddy_take(pn)
+//    Remove page `pn` from the free lists, splitting the block that holds
+//    it. Returns 0 on success, -1 if no listed block holds `pn`.
+
+static int buddy_take(int pn) {
+    for (int order = 0; order <= BUDDY_MAX_ORDER; ++order) {
+        int head = pn & ~((1 << order) - 1);
+        if (buddy_order[head] != order) {
+            continue;
+        }
+        buddy_unlink(head);
+        while (order > 0) {
+            --order;
+            int half = head + (1 << order);
+            if (pn >= half) {
+                buddy_push(head, order);
+                head = half;
+            } else {
+                buddy_push(half, order);
+            }
+        }
+        return 0;
+    }
+    return -1;
+}
+
+// buddy_init()
+//    Build the free lists from pageinfo[].
+
+static void buddy_init(void) {
+    for (int order = 0; order <= BUDDY_MAX_ORDER; ++order) {
+        buddy_head[order] = -1;
+    }
+    for (int pn = 0; pn < NPAGES; ++pn) {
+        buddy_order[pn] = -1;
+    }
+    for (int pn = 0; pn < NPAGES; ++pn) {
+        if (pageinfo[pn].refcount == 0) {
+            buddy_release(pn, 0);
+        }
+    }
+}
+
+// buddy_alloc(owner, order)
+//    Take a block of 2^`order` pages off the free lists for `owner`.
+//    Returns its physical address, or NULL. The caller holds `page_lock`.
+
+static void* buddy_alloc(int8_t owner, int order) {
+    int o = order;
+    while (o <= BUDDY_MAX_ORDER) {
+        int pn = buddy_head[o];
+        if (pn < 0) {
+            ++o;
+            continue;
+        }
+        buddy_unlink(pn);
+        // Split off the upper halves until the block is the right size
+        while (o > order) {
+            --o;
+            buddy_push(pn + (1 << o), o);
+        }
+
+        int npages = 1 << order, i = 0;
+        while (i < npages && pageinfo[pn + i].refcount == 0) {
+            ++i;
+        }
+        if (i == npages) {
+            for (i = 0; i < npages; ++i) {
+                pageinfo[pn + i].refcount = 1;
+                pageinfo[pn + i].owner = owner;
+            }
+            perf_global.pages_allocated += npages;
+            if (owner > 0) {
+                perf_proc[owner].pages_allocated += npages;
+            }
+            return (void*) PAGEADDRESS(pn);
+        }
+        // Part of the block was claimed behind our back; keep the halves
+        // in case they are free, and look again
+        if (order > 0) {
+            buddy_push(pn, order - 1);
+            buddy_push(pn + (npages >> 1), order - 1);
+        }
+        o = order;
+    }
+    return NULL;
+}
+
+// page_alloc_order(owner, order)
+//    Allocate 2^`order` physically contiguous pages, aligned to their size,
+//    for `owner`. Returns the physical address of the first page, or NULL
+//    if no such run is free.
+
+void* page_alloc_order(int8_t owner, int order) {
+    if (order < 0 || order > BUDDY_MAX_ORDER) {
+        return NULL;
+    }
+    spinlock_lock(&page_lock);
+    void* pa = buddy_alloc(owner, order);
+    spinlock_unlock(&page_lock);
+    if (!pa && this_cpu()->pcp_count) {
+        // Pages parked in this CPU's cache may complete a run
+        pcp_drain(this_cpu(), this_cpu()->pcp_count);
+        spinlock_lock(&page_lock);
+        pa = buddy_alloc(owner, order);
+        spinlock_unlock(&page_lock);
+    }
+    return pa;
+}
+
+// pcp_drain(cpu, npages)
+//    Return the oldest `npages` pages in `cpu`'s page cache to the buddy
+//    lists.
+
+static void pcp_drain(cpu_state* cpu, int npages) {
+    spinlock_lock(&page_lock);
+    for (int i = 0; i < npages; ++i) {
+        if (pageinfo[cpu->pcp[i]].refcount == 0) {
+            buddy_release(cpu->pcp[i], 0);
+        }
+    }
+    spinlock_unlock(&page_lock);
+    cpu->pcp_count -= npages;
+    memmove(cpu->pcp, cpu->pcp + npages, cpu->pcp_count * sizeof(int));
+}
+
+// pcp_alloc(owner)
+//    Allocate a page for `owner` from this CPU's page cache. Returns its
+//    physical address, or NULL if the cache holds no free page.
+
+static void* pcp_alloc(int8_t owner) {
+    cpu_state* cpu = this_cpu();
+    while (cpu->pcp_count) {
+        int pn = cpu->pcp[--cpu->pcp_count];
+        int8_t expected = 0;
+        if (__atomic_compare_exchange_n(&pageinfo[pn].refcount, &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            pageinfo[pn].owner = owner;
+            ++perf_global.pages_allocated;
+            if (owner > 0) {
+                ++perf_proc[owner].pages_allocated;
+            }
+            return (void*) PAGEADDRESS(pn);
+        }
+        // Claimed through palloc() while cached
+    }
+    return NULL;
+}
+
+// page_alloc(owner)
+//    Allocate one physical page for `owner`. Returns its physical address,
+//    or NULL if physical memory is exhausted.
+
+void* page_alloc(int8_t owner) {
+    void* pa = pcp_alloc(owner);
+    if (pa) {
+        return pa;
+    }
+    spinlock_lock(&page_lock);
+    pa = buddy_alloc(owner, 0);
+    if (!pa && zero_pool_count) {
+        pa = (void*) zero_pool[--zero_pool_count];
+        pageinfo[PAGENUMBER(pa)].owner = owner;
+        if (owner > 0) {
+            ++perf_proc[owner].pages_allocated;
+        }
+    }
+    spinlock_unlock(&page_lock);
+    return pa;
+}
+
+// page_alloc_zeroed(owner)
+//    Like page_alloc(), but the page is filled with zeros, preferably by
+//    taking it from the pre-zeroed pool.
+
+void* page_alloc_zeroed(int8_t owner) {
+    void* pa = NULL;
+    spinlock_lock(&page_lock);
+    if (zero_pool_count) {
+        pa = (void*) zero_pool[--zero_pool_count];
+        pageinfo[PAGENUMBER(pa)].owner = owner;
+        if (owner > 0) {
+            ++perf_proc[owner].pages_allocated;
+        }
+    }
+    spinlock_unlock(&page_lock);
+    if (pa) {
+        return pa;
+    }
+    pa = page_alloc(owner);
+    if (pa) {
+        memset(pa, 0, PAGESIZE);
+    }
+    return pa;
+}
+
+// zero_page_init()
+//    Allocate the shared zero page.
+
+static void zero_page_init(void) {
+    zero_page = (uintptr_t) page_alloc_zeroed(PO_KERNEL);
+    assert(zero_page);
+}
+
+// zero_pool_fill()
+//    Zero free pages into the pool while more than ZERO_POOL_RESERVE pages
+//    are free, or give pool pages back if fewer are. Called when there is
+//    nothing else to do.
+
+static void zero_pool_fill(void) {
+    int nfree = 0;
+    for (int pn = 0; pn < NPAGES; ++pn) {
+        nfree += pageinfo[pn].refcount == 0;
+    }
+    while (zero_pool_count && nfree < ZERO_POOL_RESERVE) {
+        spinlock_lock(&page_lock);
+        uintptr_t pa = zero_pool[--zero_pool_count];
+        spinlock_unlock(&page_lock);
+        freepage(pa);
+        ++nfree;
+    }
+    for (; zero_pool_count < ZERO_POOL_MAX && nfree > ZERO_POOL_RESERVE;
+         --nfree) {
+        void* pa = page_alloc_order(PO_KERNEL, 0);
+        if (!pa) {
+            return;
+        }
+        memset(pa, 0, PAGESIZE);
+        spinlock_lock(&page_lock);
+        zero_pool[zero_pool_count++] = (uintptr_t) pa;
+        spinlock_unlock(&page_lock);
+    }
+}
+
+// map_zero_page(p, va, writable)
+//    Map the shared zero page at `va` in `p`. If `writable`, the mapping is
+//    copy-on-write, so a write gives `p` its own page. Returns 0 on
+//    success, -1 on failure.
+
+int map_zero_page(proc* p, uintptr_t va, int writable) {
+    int perm = PTE_P | PTE_U | (writable ? PTE_COW : 0);
+    if (virtual_memory_map(p->p_pagetable, va, zero_page, PAGESIZE,
+                           perm) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// page_ref(pa)
+//    Add a reference to the allocated page at `pa`.
+
+void page_ref(uintptr_t pa) {
+    spinlock_lock(&page_lock);
+    assert(pageinfo[PAGENUMBER(pa)].refcount > 0);
+    ++pageinfo[PAGENUMBER(pa)].refcount;
+    spinlock_unlock(&page_lock);
 }
 
+// page_free_order(pa, order)
+//    Drop a reference to each of the 2^`order` pages starting at `pa`.
+
+void page_free_order(uintptr_t pa, int order) {
+    for (int i = 0; i < (1 << order); ++i) {
+        freepage(pa + i * PAGESIZE);
+    }
+}
 
 // assign_physical_page(addr, owner)
 //    Allocates the page with physical address `addr` to the given owner.
@@ -136,23 +785,197 @@ void process_setup(pid_t pid, int program_number) {
 //    success and -1 on failure. Used by the program loader.
 
 int assign_physical_page(uintptr_t addr, int8_t owner) {
-    if ((addr & 0xFFF) != 0
-        || addr >= MEMSIZE_PHYSICAL
-        || pageinfo[PAGENUMBER(addr)].refcount != 0) {
+    if ((addr & 0xFFF) != 0 || addr >= MEMSIZE_PHYSICAL) {
         return -1;
-    } else {
+    }
+    int r = -1;
+    spinlock_lock(&page_lock);
+    if (pageinfo[PAGENUMBER(addr)].refcount == 0) {
+        buddy_take(PAGENUMBER(addr));
         pageinfo[PAGENUMBER(addr)].refcount = 1;
         pageinfo[PAGENUMBER(addr)].owner = owner;
+        r = 0;
+    }
+    spinlock_unlock(&page_lock);
+    return r;
+}
+
+// pde_lookup(pt, va)
+//    Return a pointer to the page directory entry (the level-3 page table
+//    entry) for `va` in `pt`, or NULL if a higher level is missing.
+
+static x86_64_pageentry_t* pde_lookup(x86_64_pagetable* pt, uintptr_t va) {
+    for (int level = 0; level < 2; ++level) {
+        x86_64_pageentry_t pte = pt->entry[PAGEINDEX(va, level)];
+        if (!(pte & PTE_P)) {
+            return NULL;
+        }
+        pt = (x86_64_pagetable*) PTE_ADDR(pte);
+    }
+    return &pt->entry[PAGEINDEX(va, 2)];
+}
+
+// pde_leaf(pde, va)
+//    Return the page table entry that maps `va` under the page directory
+//    entry `*pde`. Returns 0 if `va` is unmapped.
+
+static x86_64_pageentry_t pde_leaf(x86_64_pageentry_t* pde, uintptr_t va) {
+    if (!pde || !(*pde & PTE_P)) {
         return 0;
     }
+    x86_64_pagetable* l4pt = (x86_64_pagetable*) PTE_ADDR(*pde);
+    return l4pt->entry[PAGEINDEX(va, 3)];
+}
+
+// page_disown(pagetable, va, pa)
+//    The process using `pagetable` is about to drop its mapping of physical
+//    page `pa` at `va`. If that process owns the page and others still map
+//    it, hand the page to one of them, so that no page stays owned by a
+//    process that no longer maps it. Pages shared by fork sit at the same
+//    virtual address in every sharer.
+
+static void page_disown(x86_64_pagetable* pagetable, uintptr_t va,
+                        uintptr_t pa) {
+    int pn = PAGENUMBER(pa);
+    pid_t owner = pageinfo[pn].owner;
+    if (owner <= 0 || processes[owner].p_pagetable != pagetable
+        || pageinfo[pn].refcount <= 1) {
+        return;
+    }
+    for (pid_t xpid = 1; xpid < NPROC; ++xpid) {
+        if (xpid != owner && processes[xpid].p_state != P_FREE
+            && virtual_memory_lookup(processes[xpid].p_pagetable, va).pa
+               == pa) {
+            pageinfo[pn].owner = xpid;
+            return;
+        }
+    }
 }
 
+// process_fork_cow(parent)
+//    Fork `parent` without copying its memory. Each writable user page is
+//    mapped read-only with PTE_COW in both processes and its refcount is
+//    bumped; the first write to it faults into process_cow_fault(). Returns
+//    the child's pid, or -1 on failure.
+
+pid_t process_fork_cow(proc* parent) {
+    pid_t pid = 1;
+    while (pid < NPROC && processes[pid].p_state != P_FREE) {
+        ++pid;
+    }
+    if (pid == NPROC) {
+        return -1;
+    }
+
+    proc* child = &processes[pid];
+    process_init(child, 0);
+    if (process_config_tables(pid) < 0) {
+        return -1;
+    }
+
+    for (uintptr_t va = PROC_START_ADDR; va < MEMSIZE_VIRTUAL; va += PAGESIZE) {
+        vamapping map = virtual_memory_lookup(parent->p_pagetable, va);
+        if (map.pn < 0 || !(map.perm & PTE_U)) {
+            continue;
+        }
+        int perm = map.perm;
+        if (perm & PTE_W) {
+            perm = (perm & ~PTE_W) | PTE_COW;
+            virtual_memory_map(parent->p_pagetable, va, map.pa, PAGESIZE, perm);
+        }
+        if (virtual_memory_map(child->p_pagetable, va, map.pa, PAGESIZE,
+                               perm) < 0) {
+            process_free(pid);
+            return -1;
+        }
+        if (map.pa != zero_page) {
+            page_ref(map.pa);
+        }
+    }
+
+    child->p_registers = parent->p_registers;
+    child->p_registers.reg_rax = 0;
+    child->program_break = parent->program_break;
+    child->original_break = parent->original_break;
+    child->display_status = parent->display_status;
+    child->p_state = P_RUNNABLE;
+    vm_touch(pid);
+    memset(&perf_proc[pid], 0, sizeof(perf_proc[pid]));
+    fault_around[pid] = fault_around[parent->p_pid];
+    fault_next[pid] = 0;
+    memcpy(lazy_ranges[pid], lazy_ranges[parent->p_pid],
+           sizeof(lazy_ranges[pid]));
+    program_load_fork(parent->p_pid, pid);
+    sched_base_prio[pid] = sched_base_prio[parent->p_pid];
+    sched_cpu[pid] = this_cpu() - cpus;
+    sched_set_prio(pid, sched_prio[parent->p_pid]);
+    runq_push(pid);
+    return pid;
+}
+
+
+// process_cow_fault(p, va)
+//    Resolve a write to the copy-on-write page at `va` in process `p`. The
+//    last process sharing a page just gets write access back; otherwise the
+//    page is copied. Returns 0 on success, -1 if `va` is not a COW page, and
+//    -2 if out of physical memory.
+
+int process_cow_fault(proc* p, uintptr_t va) {
+    va = ROUNDDOWN(va, PAGESIZE);
+    vamapping map = virtual_memory_lookup(p->p_pagetable, va);
+    if (map.pn < 0 || !(map.perm & PTE_COW)) {
+        return -1;
+    }
+    int perm = (map.perm & ~PTE_COW) | PTE_W;
+
+    if (map.pa != zero_page && pageinfo[map.pn].refcount == 1) {
+        pageinfo[map.pn].owner = p->p_pid;
+        virtual_memory_map(p->p_pagetable, va, map.pa, PAGESIZE, perm);
+        return 0;
+    }
+
+    void* pa;
+    if (map.pa == zero_page) {
+        pa = page_alloc_zeroed(p->p_pid);
+    } else if ((pa = page_alloc(p->p_pid))) {
+        memcpy(pa, (void*) map.pa, PAGESIZE);
+    }
+    if (!pa) {
+        return -2;
+    }
+    if (virtual_memory_map(p->p_pagetable, va, (uintptr_t) pa, PAGESIZE,
+                           perm) < 0) {
+        freepage((uintptr_t) pa);
+        return -2;
+    }
+    page_disown(p->p_pagetable, va, map.pa);
+    freepage(map.pa);
+    return 0;
+}
+
+
+// process_disown_shared(pid)
+//    Before process `pid` exits, hand each page it owns that is still shared
+//    to another process mapping it.
+
+static void process_disown_shared(pid_t pid) {
+    proc* p = &processes[pid];
+    for (uintptr_t va = PROC_START_ADDR; va < MEMSIZE_VIRTUAL; va += PAGESIZE) {
+        vamapping map = virtual_memory_lookup(p->p_pagetable, va);
+        if (map.pn >= 0) {
+            page_disown(p->p_pagetable, va, map.pa);
+        }
+    }
+}
+
+
 pid_t syscall_fork() {
-    return process_fork(current);
+    return process_fork_cow(current);
 }
 
 
 void syscall_exit() {
+    process_disown_shared(current->p_pid);
     process_free(current->p_pid);
 }
 
@@ -164,30 +987,50 @@ int syscall_page_alloc(uintptr_t addr) {
 void freepage(uintptr_t pa) {
     // Validate input
     if (pa == 0) {
-        log_printf("Error: Attempted to free null page\n");
+        klog(KLOG_ERROR, "Error: Attempted to free null page\n");
         return;
     }
     // Align the physical address to the page boundary
     uintptr_t aligned_pa = ROUNDDOWN(pa, PAGESIZE);
+    // The zero page is pinned; its mappings hold no reference
+    if (aligned_pa == zero_page) {
+        return;
+    }
     size_t page_number = aligned_pa / PAGESIZE;
     // Sanity check: Ensure the page number is valid
     if (page_number >= NPAGES) {
-        log_printf("Error: Physical address %p out of bounds\n", pa);
+        klog(KLOG_ERROR, "Error: Physical address %p out of bounds\n", pa);
         return;
     }
     // Access the pageinfo structure
+    int freed = -1;                     // -1: already free, 1: now free
+    spinlock_lock(&page_lock);
     if (pageinfo[page_number].refcount > 0) {
         // Decrement the reference count
         pageinfo[page_number].refcount--;
+        freed = pageinfo[page_number].refcount == 0;
         // If the page is no longer in use, mark it as free
-        if (pageinfo[page_number].refcount == 0) {
+        if (freed) {
+            ++perf_global.pages_freed;
+            if (pageinfo[page_number].owner > 0) {
+                ++perf_proc[pageinfo[page_number].owner].pages_freed;
+            }
             pageinfo[page_number].owner = PO_FREE; // Mark as free
-            log_printf("Page %zu (PA %p) freed successfully\n", page_number, aligned_pa);
         }
-    } 
-    else {
+    }
+    spinlock_unlock(&page_lock);
+
+    if (freed == 1) {
+        // Park the page in this CPU's cache, making room first if needed
+        cpu_state* cpu = this_cpu();
+        if (cpu->pcp_count == PCP_MAX) {
+            pcp_drain(cpu, PCP_BATCH);
+        }
+        cpu->pcp[cpu->pcp_count++] = page_number;
+        klog(KLOG_DEBUG, "Page %zu (PA %p) freed successfully\n", page_number, aligned_pa);
+    } else if (freed < 0) {
         // Error: Attempting to free a page that is already free
-        log_printf("Error: Attempted to free an unallocated page at PA %p\n", pa);
+        klog(KLOG_ERROR, "Error: Attempted to free an unallocated page at PA %p\n", pa);
     }
 }
 
@@ -200,20 +1043,21 @@ int virtual_memory_unmap(x86_64_pagetable* pagetable, uintptr_t va) {
 
     // If no mapping exists, return success
     if ((uintptr_t)map.pn == PAGE_NUMBER_INVALID) {
-        log_printf("VA %p not mapped. No action taken.\n", va);
+        klog(KLOG_DEBUG, "VA %p not mapped. No action taken.\n", va);
         return 0;
     }
 
     // Remove the mapping in the page table
     if (virtual_memory_map(pagetable, va, 0, PAGESIZE, 0) < 0) {
-        log_printf("Error: Failed to clear mapping for VA %p\n", va);
+        klog(KLOG_ERROR, "Error: Failed to clear mapping for VA %p\n", va);
         return -1; // Failed to clear mapping
     }
 
     // Free the physical page if it exists
     if (map.pa != 0) {
+        page_disown(pagetable, va, map.pa);
         freepage(map.pa);
-        log_printf("Physical page %p freed for VA %p\n", map.pa, va);
+        klog(KLOG_DEBUG, "Physical page %p freed for VA %p\n", map.pa, va);
     }
 
     return 0; // Success
@@ -221,6 +1065,80 @@ int virtual_memory_unmap(x86_64_pagetable* pagetable, uintptr_t va) {
 
 
 
+// tlb_shootdown(pagetable)
+//    Make sure no CPU still holds translations from `pagetable` that were
+//    removed before this call. This CPU reloads %cr3 if `pagetable` is
+//    loaded. Every kernel entry switches to `kernel_pagetable`, which
+//    flushes the process's translations, so for other CPUs it is enough to
+//    wait until each one running `pagetable` has entered the kernel. There
+//    is no IPI to hurry them yet, so that takes at most one timer tick.
+
+static void tlb_shootdown(x86_64_pagetable* pagetable) {
+    cpu_state* self = this_cpu();
+    if (pagetable == (x86_64_pagetable*) rcr3()) {
+        set_pagetable(pagetable);
+    }
+    for (int i = 0; i < NCPU; i++) {
+        if (&cpus[i] == self) {
+            continue;
+        }
+        while (__atomic_load_n(&cpus[i].pagetable, __ATOMIC_ACQUIRE)
+               == pagetable) {
+            asm volatile("pause");
+        }
+    }
+}
+
+
+// virtual_memory_unmap_range(pagetable, va, len)
+//    Unmap and release the pages in [`va`, `va` + `len`), which must be
+//    page-aligned. Walks down the page table once per 2 MiB, clears the
+//    level-4 entries directly, frees level-4 page tables left empty, and
+//    flushes the TLB once at the end with tlb_shootdown(). Returns 0 on success, -1 on a bad
+//    range.
+
+int virtual_memory_unmap_range(x86_64_pagetable* pagetable, uintptr_t va,
+                               size_t len) {
+    assert(pagetable != NULL);
+    if ((va | len) & (PAGESIZE - 1) || va + len < va) {
+        return -1;
+    }
+
+    uintptr_t end = va + len;
+    while (va < end) {
+        uintptr_t span_end = ROUNDDOWN(va, PDE_SPAN) + PDE_SPAN;
+        if (span_end > end) {
+            span_end = end;
+        }
+        x86_64_pageentry_t* pde = pde_lookup(pagetable, va);
+        if (pde && (*pde & PTE_P)) {
+            x86_64_pagetable* l4pt = (x86_64_pagetable*) PTE_ADDR(*pde);
+            for (; va < span_end; va += PAGESIZE) {
+                x86_64_pageentry_t* pte = &l4pt->entry[PAGEINDEX(va, 3)];
+                if (*pte & PTE_P) {
+                    uintptr_t pa = PTE_ADDR(*pte);
+                    *pte = 0;
+                    page_disown(pagetable, va, pa);
+                    freepage(pa);
+                }
+            }
+            // Release the level-4 page table if nothing is left in it
+            int index = 0;
+            while (index < NPAGETABLEENTRIES && !l4pt->entry[index]) {
+                ++index;
+            }
+            if (index == NPAGETABLEENTRIES) {
+                *pde = 0;
+                freepage((uintptr_t) l4pt);
+            }
+        }
+        va = span_end;
+    }
+
+    tlb_shootdown(pagetable);
+    return 0;
+}
+
 int sbrk(proc* p, intptr_t difference) {
     assert(p != NULL);
     assert(p->p_pagetable != NULL);
@@ -242,11 +1160,10 @@ int sbrk(proc* p, intptr_t difference) {
         uintptr_t al_newbreak = ROUNDUP(newbreak, PAGESIZE);
         
         // Unmap pages that are no longer needed
-        for (uintptr_t addr = al_newbreak; addr < al_oldbreak; addr += PAGESIZE) {
-            if (virtual_memory_unmap(p->p_pagetable, addr) < 0) {
-                log_printf("Error: Failed to unmap virtual address %p\n", addr);
-                return -1;
-            }
+        if (virtual_memory_unmap_range(p->p_pagetable, al_newbreak,
+                                       al_oldbreak - al_newbreak) < 0) {
+            klog(KLOG_ERROR, "Error: Failed to unmap virtual address %p\n", al_newbreak);
+            return -1;
         }
         p->program_break = newbreak;
     }
@@ -258,7 +1175,13 @@ void syscall_mapping(proc* p){
     uintptr_t mapping_ptr = p->p_registers.reg_rdi;
     uintptr_t ptr = p->p_registers.reg_rsi;
 
-    //convert to physical address so kernel can write to it
+    //convert to physical address so kernel can write to it; the kernel
+    //writes through the physical address, so load lazily loaded pages and
+    //break copy-on-write first
+    program_load_fault(p, mapping_ptr);
+    program_load_fault(p, mapping_ptr + sizeof(vamapping) - 1);
+    process_cow_fault(p, mapping_ptr);
+    process_cow_fault(p, mapping_ptr + sizeof(vamapping) - 1);
     vamapping map = virtual_memory_lookup(p->p_pagetable, mapping_ptr);
 
     // check for write access
@@ -276,11 +1199,76 @@ void syscall_mapping(proc* p){
     memcpy((void *)map.pa, &ptr_lookup, sizeof(vamapping));
 }
 
+// copy_to_user(p, dst, src, n)
+//    Copy `n` bytes from kernel memory `src` to address `dst` in `p`,
+//    breaking copy-on-write and loading pages as needed. Returns 0 on
+//    success, -1 if some destination page is not writable by `p`.
+
+static int copy_to_user(proc* p, uintptr_t dst, const void* src, size_t n) {
+    const uint8_t* from = src;
+    while (n > 0) {
+        size_t chunk = PAGESIZE - (dst & (PAGESIZE - 1));
+        if (chunk > n) {
+            chunk = n;
+        }
+        program_load_fault(p, dst);
+        process_cow_fault(p, dst);
+        vamapping map = virtual_memory_lookup(p->p_pagetable, dst);
+        if (map.pn < 0
+            || (map.perm & (PTE_P | PTE_W | PTE_U)) != (PTE_P | PTE_W | PTE_U)) {
+            return -1;
+        }
+        memcpy((void*) map.pa, from, chunk);
+        dst += chunk;
+        from += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
+
+// syscall_perf(p)
+//    Copy a snapshot of the performance counters to the buffer at `rdi`
+//    in `p`: the global counters if `rsi` is 0, otherwise those of process
+//    `rsi`. Returns the snapshot size in %rax, or -1 for an invalid
+//    process or buffer.
+
+void syscall_perf(proc* p) {
+    uintptr_t buf = p->p_registers.reg_rdi;
+    pid_t pid = p->p_registers.reg_rsi;
+    const perf_counters* pc = &perf_global;
+    if (pid != 0) {
+        if (pid < 1 || pid >= NPROC || processes[pid].p_state == P_FREE) {
+            p->p_registers.reg_rax = -1;
+            return;
+        }
+        pc = &perf_proc[pid];
+    }
+    perf_counters snapshot = *pc;
+    if (copy_to_user(p, buf, &snapshot, sizeof(snapshot)) < 0) {
+        p->p_registers.reg_rax = -1;
+        return;
+    }
+    p->p_registers.reg_rax = sizeof(snapshot);
+}
+
+// perf_exception_done()
+//    Charge the time since exception() was entered, if any.
+
+static void perf_exception_done(void) {
+    if (perf_entry_tsc) {
+        uint64_t cycles = perf_rdtsc() - perf_entry_tsc;
+        perf_global.exception_cycles += cycles;
+        perf_proc[perf_entry_pid].exception_cycles += cycles;
+        perf_entry_tsc = 0;
+    }
+}
+
 void syscall_mem_tog(proc* process){
 
     pid_t p = process->p_registers.reg_rdi;
     if(p == 0) {
         disp_global = !disp_global;
+        memshow_redraw = 1;
     }
     else {
         if(p < 0 || p > NPROC || p != process->p_pid)
@@ -289,6 +1277,302 @@ void syscall_mem_tog(proc* process){
     }
 }
 
+// klog_printf(level, format, ...)
+//    Format a message into the kernel log ring. Use the klog() macro,
+//    which skips disabled levels without evaluating the arguments.
+
+void klog_printf(int level, const char* format, ...) {
+    if (level > klog_level) {
+        return;
+    }
+    char msg[160];
+    va_list val;
+    va_start(val, format);
+    int n = vsnprintf(msg, sizeof(msg), format, val);
+    va_end(val);
+    if (n < 0) {
+        return;
+    } else if (n >= (int) sizeof(msg)) {
+        n = sizeof(msg) - 1;
+    }
+    for (int i = 0; i < n; ++i) {
+        klog_buf[klog_head++ % KLOG_BUFSIZE] = msg[i];
+    }
+    if (klog_head - klog_tail >= KLOG_BUFSIZE / 2) {
+        klog_flush();
+    }
+}
+
+// klog_flush()
+//    Write everything buffered in the kernel log to the host's log.
+
+void klog_flush(void) {
+    char chunk[257];
+    while (klog_tail != klog_head) {
+        unsigned n = 0;
+        while (n < sizeof(chunk) - 1 && klog_tail != klog_head) {
+            chunk[n++] = klog_buf[klog_tail++ % KLOG_BUFSIZE];
+        }
+        chunk[n] = '\0';
+        log_printf("%s", chunk);
+    }
+}
+
+// timer_set_rate(hz)
+//    Reprogram the timer to interrupt `hz` times a second.
+
+static void timer_set_rate(unsigned hz) {
+    if (hz != timer_hz) {
+        timer_init(hz);
+        timer_hz = hz;
+    }
+}
+
+// timer_tick()
+//    Account for one timer interrupt. Returns the ticks it stood for.
+
+static unsigned timer_tick(void) {
+    unsigned n = HZ / timer_hz;
+    ticks += n;
+    if (ticks - sched_last_boost >= SCHED_BOOST_TICKS) {
+        sched_last_boost = ticks;
+        for (pid_t i = 1; i < NPROC; ++i) {
+            if (processes[i].p_state != P_FREE) {
+                sched_set_prio(i, sched_base_prio[i]);
+            }
+        }
+    }
+    return n;
+}
+
+// idle_wait()
+//    Halt with interrupts enabled until the next interrupt. The interrupt
+//    enters exception() from kernel mode, which hands it to
+//    idle_interrupt(); that never comes back here.
+
+static void idle_wait(void) {
+    perf_exception_done();
+    idle_active = 1;
+    asm volatile("sti; hlt; cli" : : : "memory");
+    idle_active = 0;
+}
+
+// idle_interrupt(reg)
+//    Handle an interrupt that woke idle_wait(). The interrupted loop is
+//    abandoned: schedule() restarts at the top of the kernel stack, so idle
+//    wakeups never pile up frames. `current`'s saved registers are left
+//    alone.
+
+static void idle_interrupt(x86_64_registers* reg) __attribute__((noreturn));
+static void idle_interrupt(x86_64_registers* reg) {
+    idle_active = 0;
+    if (reg->reg_intno == INT_TIMER) {
+        timer_tick();
+    }
+    // If Control-C was typed, exit the virtual machine.
+    check_keyboard();
+    asm volatile("movq %0, %%rsp\n\t"
+                 "call schedule"
+                 : : "i" (KERNEL_STACK_TOP) : "memory");
+    __builtin_unreachable();
+}
+
+// syscall_setpriority(p)
+//    Set the base priority of process `rdi` (0 means `p` itself) to `rsi`,
+//    where 0 is the highest priority and NPRIO - 1 the lowest. Returns 0 in
+//    %rax on success, -1 on an invalid process or priority.
+
+void syscall_setpriority(proc* p) {
+    pid_t pid = p->p_registers.reg_rdi;
+    int prio = p->p_registers.reg_rsi;
+    if (pid == 0) {
+        pid = p->p_pid;
+    }
+    if (pid < 1 || pid >= NPROC || processes[pid].p_state == P_FREE
+        || prio < 0 || prio >= NPRIO) {
+        p->p_registers.reg_rax = -1;
+        return;
+    }
+    sched_base_prio[pid] = prio;
+    sched_set_prio(pid, prio);
+    p->p_registers.reg_rax = 0;
+}
+
+// syscall_faultaround(p)
+//    Set the number of heap pages `p` maps per page fault to `rdi`
+//    (0 or 1 turns fault-around off; values are capped at
+//    FAULT_AROUND_MAX). Returns the previous setting in %rax.
+
+void syscall_faultaround(proc* p) {
+    uintptr_t n = p->p_registers.reg_rdi;
+    pid_t pid = p->p_pid;
+    p->p_registers.reg_rax = fault_around[pid];
+    fault_around[pid] = n > FAULT_AROUND_MAX ? FAULT_AROUND_MAX : n;
+    fault_next[pid] = 0;
+}
+
+// map_zero_pages(p, va, npages, perm)
+//    Map `npages` fresh zeroed pages at `va` in `p` with permissions
+//    `perm`, skipping pages that are already mapped. Stops at the first
+//    page that can't be allocated or mapped. Returns the number of pages
+//    (mapped or skipped) from the start of the range that are now present.
+
+static unsigned map_zero_pages(proc* p, uintptr_t va, unsigned npages,
+                               int perm) {
+    unsigned n = 0;
+    for (; n < npages; ++n, va += PAGESIZE) {
+        vamapping mapping = virtual_memory_lookup(p->p_pagetable, va);
+        if (mapping.perm & PTE_P) {
+            continue;
+        }
+        void* pa = page_alloc_zeroed(p->p_pid);
+        if (!pa) {
+            break;
+        }
+        if (virtual_memory_map(p->p_pagetable, va, (uintptr_t) pa,
+                               PAGESIZE, perm) < 0) {
+            freepage((uintptr_t) pa);
+            break;
+        }
+    }
+    return n;
+}
+
+// heap_fault(p, page_addr, end, perm)
+//    Map zeroed pages with permissions `perm` into `p` starting at the
+//    faulting page `page_addr`, never at or beyond `end`. Returns 0 on
+//    success, -1 if the faulting page itself could not be mapped; running
+//    out of memory for the extra pages just ends the window early.
+
+static int heap_fault(proc* p, uintptr_t page_addr, uintptr_t end,
+                      int perm) {
+    pid_t pid = p->p_pid;
+    unsigned npages = 1;
+    if (fault_around[pid] > 1) {
+        if (page_addr == fault_next[pid] && fault_window[pid]) {
+            npages = fault_window[pid] * 2;
+            if (npages > fault_around[pid]) {
+                npages = fault_around[pid];
+            }
+        }
+        uintptr_t room = (ROUNDUP(end, PAGESIZE) - page_addr) / PAGESIZE;
+        if (npages > room) {
+            npages = room;
+        }
+    }
+
+    unsigned n = map_zero_pages(p, page_addr, npages, perm);
+    fault_window[pid] = n;
+    fault_next[pid] = page_addr + n * PAGESIZE;
+    return n ? 0 : -1;
+}
+
+// lazy_range_find(p, va)
+//    Return the lazy range of `p` that contains `va`, or NULL.
+
+static lazy_range* lazy_range_find(proc* p, uintptr_t va) {
+    lazy_range* r = lazy_ranges[p->p_pid];
+    for (int i = 0; i < NLAZYRANGES; ++i) {
+        if (r[i].end && va >= r[i].start && va < r[i].end) {
+            return &r[i];
+        }
+    }
+    return NULL;
+}
+
+// syscall_page_alloc_range(p)
+//    Map zeroed pages at [`rdi`, `rdi` + `rsi`) in `p`. `rdx` holds flags:
+//    PTE_W makes the pages writable, and PAGE_RANGE_LAZY records the range
+//    so pages are mapped when first touched. `rdi` and `rsi` must be
+//    page-aligned, and the range must lie above the program break and
+//    below the stack page, so it can't cover program pages that are not
+//    loaded yet. Returns in %rax the number of pages present from the
+//    start of the range (all of them on success; fewer if memory ran out),
+//    or -1 for an invalid range or if no lazy range slot is free.
+
+void syscall_page_alloc_range(proc* p) {
+    uintptr_t addr = p->p_registers.reg_rdi;
+    uintptr_t len = p->p_registers.reg_rsi;
+    int flags = p->p_registers.reg_rdx;
+    int perm = PTE_P | PTE_U | (flags & PTE_W);
+
+    if ((addr | len) & (PAGESIZE - 1)
+        || addr < ROUNDUP(p->program_break, PAGESIZE)
+        || addr > MEMSIZE_VIRTUAL - PAGESIZE
+        || len > MEMSIZE_VIRTUAL - PAGESIZE - addr) {
+        p->p_registers.reg_rax = -1;
+        return;
+    }
+
+    if (flags & PAGE_RANGE_LAZY) {
+        lazy_range* r = lazy_ranges[p->p_pid];
+        int i = 0;
+        while (i < NLAZYRANGES && r[i].end) {
+            ++i;
+        }
+        if (i == NLAZYRANGES || len == 0) {
+            p->p_registers.reg_rax = len == 0 ? 0 : -1;
+            return;
+        }
+        r[i].start = addr;
+        r[i].end = addr + len;
+        r[i].perm = perm;
+        p->p_registers.reg_rax = len / PAGESIZE;
+        return;
+    }
+
+    p->p_registers.reg_rax = map_zero_pages(p, addr, len / PAGESIZE, perm);
+}
+
+// syscall_page_free_range(p)
+//    Unmap and release the pages at [`rdi`, `rdi` + `rsi`) in `p`, and stop
+//    treating them as part of any lazy range. The range must be
+//    page-aligned and lie above the program break and below the stack
+//    page. Returns 0 in %rax on success, -1 otherwise.
+
+void syscall_page_free_range(proc* p) {
+    uintptr_t addr = p->p_registers.reg_rdi;
+    uintptr_t len = p->p_registers.reg_rsi;
+
+    if ((addr | len) & (PAGESIZE - 1)
+        || addr < ROUNDUP(p->program_break, PAGESIZE)
+        || addr > MEMSIZE_VIRTUAL - PAGESIZE
+        || len > MEMSIZE_VIRTUAL - PAGESIZE - addr) {
+        p->p_registers.reg_rax = -1;
+        return;
+    }
+    uintptr_t end = addr + len;
+
+    lazy_range* r = lazy_ranges[p->p_pid];
+    for (int i = 0; i < NLAZYRANGES; ++i) {
+        if (!r[i].end || r[i].end <= addr || r[i].start >= end) {
+            continue;
+        } else if (r[i].start >= addr && r[i].end <= end) {
+            r[i].end = 0;
+        } else if (r[i].start >= addr) {
+            r[i].start = end;
+        } else if (r[i].end <= end) {
+            r[i].end = addr;
+        } else {
+            // The range punches a hole; keep the whole lazy range if there
+            // is no slot for its upper part
+            int j = 0;
+            while (j < NLAZYRANGES && r[j].end) {
+                ++j;
+            }
+            if (j < NLAZYRANGES) {
+                r[j].start = end;
+                r[j].end = r[i].end;
+                r[j].perm = r[i].perm;
+                r[i].end = addr;
+            }
+        }
+    }
+
+    p->p_registers.reg_rax =
+        virtual_memory_unmap_range(p->p_pagetable, addr, len);
+}
+
 // exception(reg)
 //    Exception handler (for interrupts, traps, and faults).
 //
@@ -301,12 +1585,27 @@ void syscall_mem_tog(proc* process){
 //    Note that hardware interrupts are disabled whenever the kernel is running.
 
 void exception(x86_64_registers* reg) {
+    // An interrupt that woke the idle loop
+    if (idle_active) {
+        idle_interrupt(reg);
+    }
+
+    perf_entry_tsc = perf_rdtsc();
+    perf_entry_pid = current->p_pid;
+    if (reg->reg_intno >= INT_SYS
+        && reg->reg_intno < INT_SYS + PERF_NSYSCALLS) {
+        ++perf_global.syscalls[reg->reg_intno - INT_SYS];
+        ++perf_proc[current->p_pid].syscalls[reg->reg_intno - INT_SYS];
+    }
+
     // Copy the saved registers into the `current` process descriptor
     // and always use the kernel's page table.
     current->p_registers = *reg;
     set_pagetable(kernel_pagetable);
+    __atomic_store_n(&this_cpu()->pagetable, kernel_pagetable,
+                     __ATOMIC_RELEASE);
 
-    // It can be useful to log events using `log_printf`.
+    // It can be useful to log events using `klog` (or `log_printf`).
     // Events logged this way are stored in the host's `log.txt` file.
     /*log_printf("proc %d: exception %d\n", current->p_pid, reg->reg_intno);*/
 
@@ -316,10 +1615,17 @@ void exception(x86_64_registers* reg) {
     if ((reg->reg_intno != INT_PAGEFAULT
 	    && reg->reg_intno != INT_GPF)
             || (reg->reg_err & PFERR_USER)) {
-        check_virtual_memory();
-        if(disp_global){
+        uint64_t t0 = perf_rdtsc();
+        check_virtual_memory_periodic(reg->reg_intno);
+        uint64_t t1 = perf_rdtsc();
+        perf_global.check_cycles += t1 - t0;
+        perf_proc[current->p_pid].check_cycles += t1 - t0;
+        if(disp_global && memshow_frame_due()){
             memshow_physical();
             memshow_virtual_animate();
+            t0 = perf_rdtsc();
+            perf_global.memshow_cycles += t0 - t1;
+            perf_proc[current->p_pid].memshow_cycles += t0 - t1;
         }
     }
 
@@ -338,6 +1644,7 @@ void exception(x86_64_registers* reg) {
                     uintptr_t addr = current->p_registers.reg_rdi;
                     if((void *)addr == NULL)
                         kernel_panic(NULL);
+                    program_load_fault(current, addr);
                     vamapping map = virtual_memory_lookup(current->p_pagetable, addr);
                     memcpy(msg, (void *)map.pa, 160);
                     kernel_panic(msg);
@@ -371,10 +1678,27 @@ void exception(x86_64_registers* reg) {
 
         case INT_SYS_YIELD:
             {
-                schedule();
+                // A process that gives up the CPU early moves up a level
+                pid_t pid = current->p_pid;
+                if (sched_prio[pid] > sched_base_prio[pid]) {
+                    sched_set_prio(pid, sched_prio[pid] - 1);
+                }
+                schedule_next(pid);
                 break;                  /* will not be reached */
             }
 
+        case INT_SYS_SETPRIORITY:
+            {
+                syscall_setpriority(current);
+                break;
+            }
+
+        case INT_SYS_FAULTAROUND:
+            {
+                syscall_faultaround(current);
+                break;
+            }
+
         case INT_SYS_BRK:
             {
                 // TODO : Your code here
@@ -413,7 +1737,25 @@ void exception(x86_64_registers* reg) {
         case INT_SYS_PAGE_ALLOC:
             {
                 intptr_t addr = reg->reg_rdi;
-                syscall_page_alloc(addr);
+                current->p_registers.reg_rax = syscall_page_alloc(addr);
+                break;
+            }
+
+        case INT_SYS_PAGE_ALLOC_RANGE:
+            {
+                syscall_page_alloc_range(current);
+                break;
+            }
+
+        case INT_SYS_PAGE_FREE_RANGE:
+            {
+                syscall_page_free_range(current);
+                break;
+            }
+
+        case INT_SYS_PERF:
+            {
+                syscall_perf(current);
                 break;
             }
         case INT_SYS_MEM_TOG:
@@ -424,7 +1766,17 @@ void exception(x86_64_registers* reg) {
 
         case INT_TIMER:
             {
-                ++ticks;
+                // Demote processes that keep using up their allotment
+                // timer_tick() may reset sched_used[pid] in a priority
+                // boost, so call it before reading the count
+                pid_t pid = current->p_pid;
+                unsigned n = timer_tick();
+                sched_used[pid] += n;
+                if (current->p_state == P_RUNNABLE
+                    && sched_used[pid] >= sched_allotment[sched_prio[pid]]
+                    && sched_prio[pid] < NPRIO - 1) {
+                    sched_set_prio(pid, sched_prio[pid] + 1);
+                }
                 schedule();
                 break;                  /* will not be reached */
             }
@@ -446,39 +1798,54 @@ void exception(x86_64_registers* reg) {
                         addr, operation, problem, reg->reg_rip);
             }
 
-            // Check if this is a heap access within valid range
-            if (addr >= current->original_break && addr < current->program_break) {
-                // Align the faulting address to page boundary
-                uintptr_t page_addr = ROUNDDOWN(addr, PAGESIZE);
-                
-                // Check if page is already mapped
-                vamapping mapping = virtual_memory_lookup(current->p_pagetable, page_addr);
-                if (mapping.perm & PTE_P) {
+            // A write to a page shared copy-on-write since fork
+            if ((reg->reg_err & (PFERR_WRITE | PFERR_PRESENT))
+                == (PFERR_WRITE | PFERR_PRESENT)) {
+                int r = process_cow_fault(current, addr);
+                if (r == 0) {
                     current->p_state = P_RUNNABLE;
                     break;
+                } else if (r == -2) {
+                    console_printf(CPOS(24, 0), 0x0C00,
+                        "Process %d out of physical memory!\n", current->p_pid);
+                    current->p_state = P_BROKEN;
+                    break;
                 }
+            }
 
-                // Try to allocate a new physical page using palloc
-                void* pa = palloc(current->p_pid);
-                if (!pa) {
+            // A page of the program image that is loaded on demand
+            if (!(reg->reg_err & PFERR_PRESENT)) {
+                int r = program_load_fault(current, addr);
+                if (r == 0) {
+                    current->p_state = P_RUNNABLE;
+                    break;
+                } else if (r == -2) {
                     console_printf(CPOS(24, 0), 0x0C00,
                         "Process %d out of physical memory!\n", current->p_pid);
                     current->p_state = P_BROKEN;
                     break;
                 }
+            }
 
-                // Initialize the page to zero
-                memset(pa, 0, PAGESIZE);
+            // Check if this is a heap access within valid range
+            if (addr >= current->original_break && addr < current->program_break) {
+                // Align the faulting address to page boundary
+                uintptr_t page_addr = ROUNDDOWN(addr, PAGESIZE);
 
-                // Map the new page into the process's address space
-                int r = virtual_memory_map(current->p_pagetable, 
-                                        page_addr,              // virtual address
-                                        (uintptr_t)pa,         // physical address
-                                        PAGESIZE,               // size
-                                        PTE_P | PTE_W | PTE_U); // permissions
+                // Reads of untouched memory share the zero page, unless
+                // fault-around wants to map a window of pages
+                if (!(reg->reg_err & PFERR_WRITE)
+                    && fault_around[current->p_pid] <= 1
+                    && map_zero_page(current, page_addr, 1) == 0) {
+                    current->p_state = P_RUNNABLE;
+                    break;
+                }
 
-                if (r < 0) {
-                    freepage((uintptr_t)pa);
+                // Map the page, plus its neighbors if fault-around is on
+                if (heap_fault(current, page_addr, current->program_break,
+                               PTE_P | PTE_W | PTE_U) < 0) {
+                    console_printf(CPOS(24, 0), 0x0C00,
+                        "Process %d out of physical memory!\n", current->p_pid);
                     current->p_state = P_BROKEN;
                     break;
                 }
@@ -487,6 +1854,28 @@ void exception(x86_64_registers* reg) {
                 break;
         }
 
+        // A first touch of a page in a lazily allocated range
+        lazy_range* lazy = lazy_range_find(current, addr);
+        if (lazy && !(reg->reg_err & PFERR_PRESENT)) {
+            uintptr_t page_addr = ROUNDDOWN(addr, PAGESIZE);
+            if (!(reg->reg_err & PFERR_WRITE)
+                && fault_around[current->p_pid] <= 1
+                && map_zero_page(current, page_addr,
+                                 lazy->perm & PTE_W) == 0) {
+                current->p_state = P_RUNNABLE;
+                break;
+            }
+            if (heap_fault(current, ROUNDDOWN(addr, PAGESIZE), lazy->end,
+                           lazy->perm) < 0) {
+                console_printf(CPOS(24, 0), 0x0C00,
+                    "Process %d out of physical memory!\n", current->p_pid);
+                current->p_state = P_BROKEN;
+                break;
+            }
+            current->p_state = P_RUNNABLE;
+            break;
+        }
+
         // If not in heap range or other error, terminate process as before
         console_printf(CPOS(24, 0), 0x0C00,
             "Process %d page fault for %p (%s %s, rip=%p)!\n",
@@ -518,6 +1907,16 @@ void exception(x86_64_registers* reg) {
 
     }
 
+    if (reg->reg_intno == INT_PAGEFAULT) {
+        if (current->p_state == P_RUNNABLE) {
+            ++perf_global.faults_handled;
+            ++perf_proc[current->p_pid].faults_handled;
+        } else {
+            ++perf_global.faults_fatal;
+            ++perf_proc[current->p_pid].faults_fatal;
+        }
+    }
+
     // Return to the current process (or run something else).
     if (current->p_state == P_RUNNABLE) {
         run(current);
@@ -527,38 +1926,196 @@ void exception(x86_64_registers* reg) {
 }
 
 
-// schedule
-//    Pick the next process to run and then run it.
-//    If there are no runnable processes, spins forever.
+// runq_push(pid), runq_remove(pid)
+//    Add process `pid` to the tail of the run queue for its level on CPU
+//    `sched_cpu[pid]`, or take it out of whichever queue holds it.
 
-void schedule(void) {
-    pid_t pid = current->p_pid;
+static void runq_unlink(cpu_state* cpu, pid_t pid) {
+    int level = sched_prio[pid];
+    if (runq_prev[pid]) {
+        runq_next[runq_prev[pid]] = runq_next[pid];
+    } else {
+        cpu->runq_head[level] = runq_next[pid];
+    }
+    if (runq_next[pid]) {
+        runq_prev[runq_next[pid]] = runq_prev[pid];
+    } else {
+        cpu->runq_tail[level] = runq_prev[pid];
+    }
+    if (!cpu->runq_head[level]) {
+        cpu->runq_mask &= ~(1U << level);
+    }
+    runq_queued[pid] = 0;
+}
+
+static void runq_push(pid_t pid) {
+    cpu_state* cpu = &cpus[sched_cpu[pid]];
+    spinlock_lock(&cpu->runq_lock);
+    if (!runq_queued[pid]) {
+        int level = sched_prio[pid];
+        runq_next[pid] = 0;
+        runq_prev[pid] = cpu->runq_tail[level];
+        if (cpu->runq_tail[level]) {
+            runq_next[cpu->runq_tail[level]] = pid;
+        } else {
+            cpu->runq_head[level] = pid;
+        }
+        cpu->runq_tail[level] = pid;
+        runq_queued[pid] = 1;
+        cpu->runq_mask |= 1U << level;
+    }
+    spinlock_unlock(&cpu->runq_lock);
+}
+
+static void runq_remove(pid_t pid) {
+    cpu_state* cpu = &cpus[sched_cpu[pid]];
+    spinlock_lock(&cpu->runq_lock);
+    if (runq_queued[pid]) {
+        runq_unlink(cpu, pid);
+    }
+    spinlock_unlock(&cpu->runq_lock);
+}
+
+// runq_empty()
+//    Return 1 if no process is queued on any CPU.
+
+static int runq_empty(void) {
+    for (int i = 0; i < NCPU; i++) {
+        if (__atomic_load_n(&cpus[i].runq_mask, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// sched_set_prio(pid, prio)
+//    Move process `pid` to level `prio` with a fresh allotment.
+
+static void sched_set_prio(pid_t pid, int prio) {
+    int queued = runq_queued[pid];
+    runq_remove(pid);
+    sched_prio[pid] = prio;
+    sched_used[pid] = 0;
+    if (queued) {
+        runq_push(pid);
+    }
+}
+
+
+// runq_take(cpu, skip)
+//    Remove and return the first process in the highest nonempty queue of
+//    `cpu`, passing over `skip`. Returns 0 if nothing else is queued there.
+
+static pid_t runq_take(cpu_state* cpu, pid_t skip) {
+    pid_t pid = 0;
+    spinlock_lock(&cpu->runq_lock);
+    for (unsigned mask = cpu->runq_mask; mask && !pid; mask &= mask - 1) {
+        pid = cpu->runq_head[__builtin_ctz(mask)];
+        if (pid == skip) {
+            pid = runq_next[pid];
+        }
+    }
+    if (pid) {
+        runq_unlink(cpu, pid);
+    }
+    spinlock_unlock(&cpu->runq_lock);
+    return pid;
+}
+
+// runq_pick(skip)
+//    Remove and return the next process for this CPU to run: the best
+//    process on its own queues, else the best one stolen from another CPU,
+//    passing over `skip` unless nothing else is queued anywhere. Returns 0
+//    if all queues are empty.
+
+static pid_t runq_pick(pid_t skip) {
+    cpu_state* self = this_cpu();
+    pid_t pid = runq_take(self, skip);
+    for (int i = 0; i < NCPU && !pid; i++) {
+        if (&cpus[i] != self) {
+            pid = runq_take(&cpus[i], skip);
+        }
+    }
+    if (!pid && skip && runq_queued[skip]) {
+        runq_remove(skip);
+        pid = skip;
+    }
+    return pid;
+}
+
+// schedule_next(skip)
+//    Pick the next process to run and then run it, preferring any process
+//    other than `skip`. The current process, if it can still run, goes to
+//    the back of its queue first.
+//    If there are no runnable processes, halts until an interrupt arrives.
+
+static void schedule_next(pid_t skip) {
+    if (current->p_state == P_RUNNABLE) {
+        runq_push(current->p_pid);
+    }
     while (1) {
-        pid = (pid + 1) % NPROC;
-        if (processes[pid].p_state == P_RUNNABLE) {
+        // runq_pick() dequeues the process; one that can no longer run is
+        // simply dropped
+        pid_t pid = runq_pick(skip);
+        if (pid && processes[pid].p_state == P_RUNNABLE) {
             run(&processes[pid]);
         }
         // If Control-C was typed, exit the virtual machine.
         check_keyboard();
+        // Nothing can run: sleep until an interrupt instead of spinning
+        if (runq_empty()) {
+            klog_flush();
+            zero_pool_fill();
+            if (TICKLESS) {
+                timer_set_rate(TICKLESS_HZ);
+            }
+            idle_wait();
+        }
     }
 }
 
 
+// schedule
+//    Pick the next process to run and then run it. The current process
+//    runs again right away only if nothing of equal or higher priority is
+//    waiting.
+
+void schedule(void) {
+    schedule_next(0);
+}
+
+
 // run(p)
 //    Run process `p`. This means reloading all the registers from
 //    `p->p_registers` using the `popal`, `popl`, and `iret` instructions.
 //
-//    As a side effect, sets `current = p`.
+//    As a side effect, sets `current = p` and makes this CPU the one whose
+//    queues hold `p` from now on.
 
 void run(proc* p) {
     assert(p->p_state == P_RUNNABLE);
+    cpu_state* cpu = this_cpu();
     current = p;
+    runq_remove(p->p_pid);
+    sched_cpu[p->p_pid] = cpu - cpus;
+    if (p->p_pid != perf_last_run) {
+        ++perf_global.context_switches;
+        ++perf_proc[p->p_pid].context_switches;
+        perf_last_run = p->p_pid;
+    }
+    perf_exception_done();
 
     // display running process in CONSOLE last value
     console_printf(CPOS(24, 79),
             memstate_colors[p->p_pid - PO_KERNEL], "%d", p->p_pid);
 
+    // Only tick at full rate if other processes are waiting for the CPU
+    if (TICKLESS) {
+        timer_set_rate(runq_empty() ? TICKLESS_HZ : HZ);
+    }
+
     // Load the process's current pagetable.
+    __atomic_store_n(&cpu->pagetable, p->p_pagetable, __ATOMIC_RELEASE);
     set_pagetable(p->p_pagetable);
 
     // This function is defined in k-exception.S. It restores the process's
@@ -588,6 +2145,8 @@ void pageinfo_init(void) {
         pageinfo[PAGENUMBER(addr)].owner = owner;
         pageinfo[PAGENUMBER(addr)].refcount = (owner != PO_FREE);
     }
+
+    buddy_init();
 }
 
 
@@ -694,6 +2253,105 @@ void check_virtual_memory(void) {
     }
 }
 
+// vm_touch(pid)
+//    Note that process `pid`'s page tables or pages may have changed, so
+//    the next dirty check revalidates them.
+
+static void vm_touch(pid_t pid) {
+    vm_dirty[pid] = 1;
+    vm_any_dirty = 1;
+}
+
+// check_virtual_memory_dirty
+//    Like check_virtual_memory(), but only walks the page tables of
+//    processes touched since the last check. Does nothing if none were.
+
+static void check_virtual_memory_dirty(void) {
+    if (!vm_any_dirty) {
+        return;
+    }
+    assert(processes[0].p_state == P_FREE);
+
+    check_page_table_mappings(kernel_pagetable);
+    check_page_table_ownership(kernel_pagetable, -1);
+
+    for (int pid = 0; pid < NPROC; ++pid) {
+        if (vm_dirty[pid]
+            && processes[pid].p_state != P_FREE
+            && processes[pid].p_pagetable != kernel_pagetable) {
+            check_page_table_mappings(processes[pid].p_pagetable);
+            check_page_table_ownership(processes[pid].p_pagetable, pid);
+        }
+        vm_dirty[pid] = 0;
+    }
+
+    for (int pn = 0; pn < PAGENUMBER(MEMSIZE_PHYSICAL); ++pn) {
+        if (pageinfo[pn].refcount > 0 && pageinfo[pn].owner >= 0) {
+            assert(processes[pageinfo[pn].owner].p_state != P_FREE);
+        }
+    }
+    vm_any_dirty = 0;
+}
+
+// check_virtual_memory_periodic(intno)
+//    Run the virtual memory checks `vmcheck_mode` asks for after a trap
+//    with interrupt number `intno`. Timer interrupts don't change memory,
+//    so every other trap marks the current process dirty.
+
+static void check_virtual_memory_periodic(int intno) {
+    if (intno != INT_TIMER) {
+        vm_touch(current->p_pid);
+    }
+    if (vmcheck_mode == VMCHECK_FULL) {
+        check_virtual_memory();
+    } else if (vmcheck_mode == VMCHECK_DIRTY) {
+        check_virtual_memory_dirty();
+    } else if (vmcheck_mode == VMCHECK_SAMPLED
+               && ++vmcheck_traps >= VMCHECK_INTERVAL) {
+        vmcheck_traps = 0;
+        check_virtual_memory();
+    }
+}
+
+// command_word(command, word)
+//    Return 1 if the first space-separated word of `command` is `word`.
+
+static int command_word(const char* command, const char* word) {
+    if (!command) {
+        return 0;
+    }
+    while (*word && *command == *word) {
+        ++command;
+        ++word;
+    }
+    return !*word && (!*command || *command == ' ');
+}
+
+// command_option(command, name)
+//    Return a pointer to the value of option `name` (e.g. "check=") in
+//    `command`, or NULL if no word of `command` starts with `name`.
+
+static const char* command_option(const char* command, const char* name) {
+    while (command && *command) {
+        const char* c = command;
+        const char* n = name;
+        while (*n && *c == *n) {
+            ++c;
+            ++n;
+        }
+        if (!*n) {
+            return c;
+        }
+        while (*command && *command != ' ') {
+            ++command;
+        }
+        while (*command == ' ') {
+            ++command;
+        }
+    }
+    return NULL;
+}
+
 // memshow_physical
 //    Draw a picture of physical memory on the CGA console.
 
@@ -708,9 +2366,12 @@ static const uint16_t memstate_colors[] = {
 #define SHARED
 
 void memshow_physical(void) {
-    console_printf(CPOS(0, 32), 0x0F00, "PHYSICAL MEMORY");
+    int redraw = memshow_redraw;
+    if (redraw) {
+        console_printf(CPOS(0, 32), 0x0F00, "PHYSICAL MEMORY");
+    }
     for (int pn = 0; pn < PAGENUMBER(MEMSIZE_PHYSICAL); ++pn) {
-        if (pn % 64 == 0) {
+        if (redraw && pn % 64 == 0) {
             console_printf(CPOS(1 + pn / 64, 3), 0x0F00, "0x%06X ", pn << 12);
         }
 
@@ -728,41 +2389,67 @@ void memshow_physical(void) {
 #endif
         }
 
-        console[CPOS(1 + pn / 64, 12 + pn % 64)] = color;
+        if (redraw || memshow_phys_cells[pn] != color) {
+            memshow_phys_cells[pn] = color;
+            console[CPOS(1 + pn / 64, 12 + pn % 64)] = color;
+        }
     }
 }
 
 
+// memshow_frame_due
+//    Return 1 if it is time to draw another memory viewer frame.
+
+static int memshow_frame_due(void) {
+    if (memshow_redraw || ticks - memshow_last_frame >= HZ / MEMSHOW_FPS) {
+        memshow_last_frame = ticks;
+        return 1;
+    }
+    return 0;
+}
+
 // memshow_virtual(pagetable, name)
 //    Draw a picture of the virtual memory map `pagetable` (named `name`) on
 //    the CGA console.
 
 void memshow_virtual(x86_64_pagetable* pagetable, const char* name) {
     assert((uintptr_t) pagetable == PTE_ADDR(pagetable));
+    static x86_64_pagetable* last_pagetable;
+    int redraw = memshow_redraw;
 
-    console_printf(CPOS(10, 26), 0x0F00, "VIRTUAL ADDRESS SPACE FOR %s", name);
+    if (redraw || pagetable != last_pagetable) {
+        console_printf(CPOS(10, 26), 0x0F00, "VIRTUAL ADDRESS SPACE FOR %s", name);
+        last_pagetable = pagetable;
+    }
+    x86_64_pageentry_t* pde = NULL;
     for (uintptr_t va = 0; va < MEMSIZE_VIRTUAL; va += PAGESIZE) {
-        vamapping vam = virtual_memory_lookup(pagetable, va);
+        // Walk down to the page directory once per 2 MiB, not per page
+        if (va % PDE_SPAN == 0) {
+            pde = pde_lookup(pagetable, va);
+        }
+        x86_64_pageentry_t pte = pde_leaf(pde, va);
         uint16_t color;
-        if (vam.pn < 0) {
+        if (!(pte & PTE_P)) {
             color = ' ';
         } else {
-            assert(vam.pa < MEMSIZE_PHYSICAL);
-            int owner = pageinfo[vam.pn].owner;
-            if (pageinfo[vam.pn].refcount == 0) {
+            uintptr_t pa = PTE_ADDR(pte);
+            int pn = PAGENUMBER(pa);
+            assert(pa < MEMSIZE_PHYSICAL);
+            int owner = pageinfo[pn].owner;
+            if (pageinfo[pn].refcount == 0) {
                 owner = PO_FREE;
             }
             color = memstate_colors[owner - PO_KERNEL];
             // reverse video for user-accessible pages
-            if (vam.perm & PTE_U) {
+            if (pte & PTE_U) {
                 color = ((color & 0x0F00) << 4) | ((color & 0xF000) >> 4)
                     | (color & 0x00FF);
             }
             // darker color for shared pages
-            if (pageinfo[vam.pn].refcount > 1 && va != CONSOLE_ADDR) {
+            if (pageinfo[pn].refcount > 1 && va != CONSOLE_ADDR) {
 #ifdef SHARED
                 color = (SHARED_COLOR | (color & 0xF000));
-                if(! (vam.perm & PTE_U))
+                if(! (pte & PTE_U))
                     color = color | 0x0F00;
 
 #else
@@ -771,10 +2458,13 @@ void memshow_virtual(x86_64_pagetable* pagetable, const char* name) {
             }
         }
         uint32_t pn = PAGENUMBER(va);
-        if (pn % 64 == 0) {
+        if (redraw && pn % 64 == 0) {
             console_printf(CPOS(11 + pn / 64, 3), 0x0F00, "0x%06X ", va);
         }
-        console[CPOS(11 + pn / 64, 12 + pn % 64)] = color;
+        if (redraw || memshow_virt_cells[pn] != color) {
+            memshow_virt_cells[pn] = color;
+            console[CPOS(11 + pn / 64, 12 + pn % 64)] = color;
+        }
     }
 }
 
@@ -805,4 +2495,5 @@ void memshow_virtual_animate(void) {
         snprintf(s, 4, "%d ", showing);
         memshow_virtual(processes[showing].p_pagetable, s);
     }
+    memshow_redraw = 0;
 }
\ No newline at end of file
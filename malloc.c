@@ -1,15 +1,33 @@
 #include "malloc.h"
+#include "syscall.h"
 
 
 #define UINT64_MAX ((uint64_t)-1)
 
+#ifndef PAGESIZE
+#define PAGESIZE 4096
+#endif
+#ifndef ENOMEM
+#define ENOMEM 12
+#endif
+#ifndef EINVAL
+#define EINVAL 22
+#endif
+
+#ifndef PTE_W
+#define PTE_W 2
+#endif
+
 typedef struct free_block {
     size_t size;                 // Size of the block, including header
     struct free_block* next;     // Pointer to the next free block
     struct free_block* prev;     // Pointer to the previous free block
     int freed;                   // Indicates whether the block is free (1 for free, 0 for allocated)
+    int prev_freed;              // 1 if the block physically below this one is free
 } free_block;
 
+#define MIN_BLOCK_SIZE (sizeof(free_block) + 8)
+
 typedef struct ptr_with_size {
     void* ptr;
     long size;
@@ -19,101 +37,747 @@ static ptr_with_size *allocation_array;
 static size_t array_index = 0;
 
 
-static free_block* head = NULL; // Start of the free list
 static void* heap_start = NULL;           // Start of the heap
 static void* heap_end = NULL;             // End of the heap
 static int true = 0 ; 
 static int total_allocations = 0;
 
+// `freed` values for heap blocks that hold an arena chunk or a pool slab.
+// Such blocks are neither free nor counted as allocations.
+#define BLOCK_ARENA 2
+#define BLOCK_SLAB 3
+static free_block* heap_tail = NULL;      // Last block in the heap
+static free_block* defrag_cursor = NULL;  // Next block defrag_step() visits
+static uintptr_t region_floor = 0;        // Bottom of the region area
+static uintptr_t region_top = 0;          // Top of the region area
+
+
+// Free blocks are kept in segregated bins keyed by block size (header
+// included). Each of the first NSMALLBINS bins holds exactly one size, a
+// multiple of 8 bytes; every bin after that covers a power-of-two range.
+// Only freed blocks are in a bin, so malloc never steps over allocated
+// memory. `binmap` has a bit set for every nonempty bin. The bin counts
+// are in malloc.h, since heap_stats() reports free blocks per bin.
+#define SMALLBIN_LIMIT (NSMALLBINS * 8)
+#define SMALLBIN_SHIFT 9                // log2(SMALLBIN_LIMIT)
+#define BINMAP_WORDS ((NBINS + 63) / 64)
+#define MAX_BIN_SCAN 8                  // blocks checked in a large bin
+
+static free_block* bins[NBINS];
+static uint64_t binmap[BINMAP_WORDS];
+
+// Running statistics, kept up to date by every operation so heap_stats()
+// can report them without walking the heap. `bin_max[idx]` caches the
+// largest block in large bin `idx`; 0 means it must be recomputed.
+static long free_bytes = 0;               // bytes in binned free blocks
+static long cached_bytes = 0;             // bytes held by the tcache
+static long peak_in_use = 0;
+static long sbrk_bytes = 0;               // bytes ever obtained from sbrk()
+static int bin_count[NBINS];
+static uint64_t bin_max[NBINS];
+
+static int bin_index(uint64_t size) {
+    if (size < SMALLBIN_LIMIT) {
+        return size >> 3;
+    }
+    int idx = NSMALLBINS + (63 - __builtin_clzll(size)) - SMALLBIN_SHIFT;
+    return idx < NBINS ? idx : NBINS - 1;
+}
+
+static void bin_insert(free_block* block) {
+    int idx = bin_index(block->size);
+    block->prev = NULL;
+    block->next = bins[idx];
+    if (bins[idx]) {
+        bins[idx]->prev = block;
+    }
+    if (!bins[idx] || (bin_max[idx] && block->size > bin_max[idx])) {
+        bin_max[idx] = block->size;
+    }
+    bins[idx] = block;
+    binmap[idx >> 6] |= 1ULL << (idx & 63);
+    bin_count[idx]++;
+    free_bytes += block->size;
+}
+
+static void bin_remove(free_block* block) {
+    int idx = bin_index(block->size);
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        bins[idx] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    if (!bins[idx]) {
+        binmap[idx >> 6] &= ~(1ULL << (idx & 63));
+    }
+    if (!bins[idx] || block->size == bin_max[idx]) {
+        bin_max[idx] = 0;
+    }
+    bin_count[idx]--;
+    free_bytes -= block->size;
+    block->next = NULL;
+    block->prev = NULL;
+}
+
+// Return the first nonempty bin at index `idx` or above, or -1.
+static int binmap_next(int idx) {
+    for (int w = idx >> 6; w < BINMAP_WORDS; w++) {
+        uint64_t bits = binmap[w];
+        if (w == idx >> 6) {
+            bits &= ~0ULL << (idx & 63);
+        }
+        if (bits) {
+            return (w << 6) + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+// Return the size of the largest free block, or 0 if there is none.
+static uint64_t bin_largest(void) {
+    int idx = -1;
+    for (int w = BINMAP_WORDS - 1; w >= 0 && idx < 0; w--) {
+        if (binmap[w]) {
+            idx = (w << 6) + 63 - __builtin_clzll(binmap[w]);
+        }
+    }
+    if (idx < 0) {
+        return 0;
+    }
+    if (!bin_max[idx]) {
+        for (free_block* current = bins[idx]; current; current = current->next) {
+            if (current->size > bin_max[idx]) {
+                bin_max[idx] = current->size;
+            }
+        }
+    }
+    return bin_max[idx];
+}
+
+// Find a free block of at least `size` bytes, or NULL.
+static free_block* bin_find(uint64_t size) {
+    int idx = bin_index(size);
+
+    // A large bin spans a range of sizes, so only some of its blocks fit.
+    // Look at a few of them before moving on to a bigger bin.
+    if (idx >= NSMALLBINS) {
+        free_block* current = bins[idx];
+        for (int n = 0; current && n < MAX_BIN_SCAN; n++) {
+            if (current->size >= size) {
+                return current;
+            }
+            current = current->next;
+        }
+        idx++;
+    }
+
+    // Every block in a small bin of the right size, or in any bigger bin,
+    // is large enough.
+    idx = idx < NBINS ? binmap_next(idx) : -1;
+    return idx >= 0 ? bins[idx] : NULL;
+}
+
+// Blocks are laid out back to back between heap_start and heap_end, so the
+// physical successor of a block is found from its size.
+static free_block* block_next(free_block* block) {
+    free_block* next = (free_block*)((char*)block + block->size);
+    return (void*)next < heap_end ? next : NULL;
+}
+
+static free_block* block_first(void) {
+    return heap_start != heap_end ? (free_block*)heap_start : NULL;
+}
+
+// Bytes in blocks that are neither free nor cached, headers included.
+static long heap_in_use(void) {
+    return ((char*)heap_end - (char*)heap_start) - free_bytes - cached_bytes;
+}
+
+// Call once an allocation has fully settled.
+static void heap_note_peak(void) {
+    if (heap_in_use() > peak_in_use) {
+        peak_in_use = heap_in_use();
+    }
+}
+
+// A free block repeats its size in its last 8 bytes (a boundary tag).
+// With `prev_freed` in the next header this finds the block physically
+// below in O(1). Allocated blocks carry no footer.
+static void block_set_footer(free_block* block) {
+    *(size_t*)((char*)block + block->size - sizeof(size_t)) = block->size;
+}
+
+static free_block* block_prev(free_block* block) {
+    if (!block->prev_freed) {
+        return NULL;
+    }
+    size_t prev_size = *(size_t*)((char*)block - sizeof(size_t));
+    return (free_block*)((char*)block - prev_size);
+}
 
+// Mark `block` free or allocated and let its physical successor know.
+static void block_mark(free_block* block, int freed) {
+    block->freed = freed;
+    if (freed) {
+        block_set_footer(block);
+    }
+    free_block* next = block_next(block);
+    if (next) {
+        next->prev_freed = freed;
+    }
+}
+
+// Grow `block` over its physical successor `next`.
+static void block_absorb(free_block* block, free_block* next) {
+    block->size += next->size;
+    if (next == heap_tail) {
+        heap_tail = block;
+    }
+    if (next == defrag_cursor) {
+        defrag_cursor = block;
+    }
+}
+
+// Merge `block`, which is not in a bin, with its free physical neighbors.
+// Returns the merged block, which is not in a bin either.
+static free_block* block_coalesce(free_block* block) {
+    free_block* next = block_next(block);
+    if (next && next->freed == 1) {
+        // app_printf(0, "free: Coalescing with next block\n");
+        bin_remove(next);
+        block_absorb(block, next);
+    }
+
+    free_block* prev = block_prev(block);
+    if (prev) {
+        // app_printf(0, "free: Coalescing with previous block\n");
+        bin_remove(prev);
+        block_absorb(prev, block);
+        block = prev;
+    }
+    return block;
+}
 
 
 void initialize_heap() {
     if (!heap_start) {
         heap_start = sbrk(0); // Get current program break
         heap_end = heap_start;
+        // The region area starts empty, an unmapped guard page under the
+        // stack page
+        region_top = ROUNDDOWN(read_rsp(), PAGESIZE) - PAGESIZE;
+        region_floor = region_top;
     }
 }
 
-void free(void* ptr) {
-    if (!ptr) {
-        // app_printf(0, "free: Null pointer passed, nothing to free.\n");
+
+// The heap grows by at least heap_grow_size bytes per sbrk() call, and that
+// step doubles each time up to HEAP_GROW_MAX. Pages are only mapped when
+// touched, so a large step costs address space, not memory. Once the free
+// block at the top of the heap reaches HEAP_TRIM_THRESHOLD, all but
+// HEAP_TRIM_KEEP bytes of it are given back to the kernel.
+#define HEAP_GROW_MIN 0x10000           // 64 KiB
+#define HEAP_GROW_MAX 0x20000           // 128 KiB
+#define HEAP_TRIM_THRESHOLD 0x40000     // 256 KiB
+#define HEAP_TRIM_KEEP HEAP_GROW_MIN
+
+static uint64_t heap_grow_size = HEAP_GROW_MIN;
+
+// The heap may not grow into the region area below the stack.
+static int heap_has_room(uint64_t increment) {
+    return (uintptr_t)heap_end <= region_floor
+        && increment <= region_floor - (uintptr_t)heap_end;
+}
+
+// Extend the heap so that its top block is free and at least `size` bytes.
+// Returns that block, which is in a bin, or NULL if sbrk() fails.
+static free_block* heap_grow(uint64_t size) {
+    free_block* top = heap_tail && heap_tail->freed == 1 ? heap_tail : NULL;
+    if (top && top->size >= size) {
+        return top;
+    }
+
+    // A free block at the top only needs topping up
+    uint64_t need = top ? size - top->size : size;
+    if (need < MIN_BLOCK_SIZE) {
+        need = MIN_BLOCK_SIZE;
+    }
+    uint64_t increment = ROUNDUP(need, PAGESIZE);
+    if (increment < heap_grow_size) {
+        increment = heap_grow_size;
+    }
+
+    void* addr = (void*)-1;
+    if (heap_has_room(increment)) {
+        addr = sbrk(increment);
+    }
+    if (addr != (void*)-1) {
+        if (heap_grow_size < HEAP_GROW_MAX) {
+            heap_grow_size *= 2;
+        }
+    } else if (heap_has_room(need)) {
+        // Near the stack there may be no room for a full step
+        increment = need;
+        addr = sbrk(increment);
+    }
+    if (addr == (void*)-1) {
+        return NULL;
+    }
+    sbrk_bytes += increment;
+
+    // The new block sits at the old end of the heap
+    free_block* block = (free_block*)addr;
+    block->size = increment;
+    block->prev_freed = top != NULL;
+    heap_end = (char*)addr + increment;
+    heap_tail = block;
+
+    if (top) {
+        bin_remove(top);
+        block_absorb(top, block);
+        block = top;
+    }
+    block_mark(block, 1);
+    bin_insert(block);
+    return block;
+}
+
+// Give all but HEAP_TRIM_KEEP bytes of `top`, the free block at the top of
+// the heap, back to the kernel. `top` must not be in a bin.
+static void heap_trim(free_block* top) {
+    uint64_t release = ROUNDDOWN(top->size - HEAP_TRIM_KEEP, PAGESIZE);
+    if (sbrk(-(intptr_t)release) == (void*)-1) {
         return;
     }
+    top->size -= release;
+    heap_end = (char*)heap_end - release;
+    heap_grow_size = HEAP_GROW_MIN;
+}
 
-    total_allocations--;
-    // app_printf(0, "free: Pointer %p received for freeing. Total allocations now: %d\n", 
-    //            ptr, total_allocations);
+// Return `block` to the bins, merging it with its free neighbors.
+static void block_release(free_block* block) {
+    block = block_coalesce(block);
+    if (block == heap_tail && block->size >= HEAP_TRIM_THRESHOLD) {
+        heap_trim(block);
+    }
+    block_mark(block, 1);
+    bin_insert(block);
+}
+
+// Cut allocated `block` down to `size` bytes and release the rest, if the
+// rest is big enough to be a block of its own.
+static void block_shrink(free_block* block, uint64_t size) {
+    if (block->size < size + MIN_BLOCK_SIZE) {
+        return;
+    }
+    free_block* rest = (free_block*)((char*)block + size);
+    rest->size = block->size - size;
+    rest->freed = 0;
+    rest->prev_freed = 0;
+    rest->next = NULL;
+    rest->prev = NULL;
+    block->size = size;
+    if (block == heap_tail) {
+        heap_tail = rest;
+    }
+    block_release(rest);
+}
+
+// Return the lowest payload address for a block starting at or above
+// `start` that is `offset` bytes past a multiple of `align`, with room
+// below the header for nothing or for a block of its own.
+static uintptr_t aligned_payload(uintptr_t start, uint64_t align,
+                                 uint64_t offset) {
+    uintptr_t aligned =
+        ROUNDUP(start + sizeof(free_block) - offset, align) + offset;
+    uint64_t pad = aligned - sizeof(free_block) - start;
+    // Padding below the block must be big enough to be a block itself
+    if (pad != 0 && pad < MIN_BLOCK_SIZE) {
+        aligned += align;
+    }
+    return aligned;
+}
+
+// Find a binned free block that can hold a `total_size`-byte block whose
+// payload is `offset` bytes past a multiple of `align`, looking at up to
+// MAX_BIN_SCAN blocks per bin. Returns NULL if there is none.
+static free_block* bin_find_aligned(uint64_t align, uint64_t offset,
+                                    uint64_t total_size) {
+    int idx = binmap_next(bin_index(total_size));
+    while (idx >= 0) {
+        free_block* current = bins[idx];
+        for (int n = 0; current && n < MAX_BIN_SCAN; n++) {
+            uintptr_t start = (uintptr_t)current;
+            uintptr_t aligned = aligned_payload(start, align, offset);
+            if (aligned - sizeof(free_block) + total_size
+                <= start + current->size) {
+                return current;
+            }
+            current = current->next;
+        }
+        idx = idx + 1 < NBINS ? binmap_next(idx + 1) : -1;
+    }
+    return NULL;
+}
+
+// Carve an allocated block of `total_size` bytes with its payload at
+// `aligned` out of free block `top`, which is not in a bin. Padding below
+// the block stays free, and so does whatever is left above it. Returns the
+// payload.
+static void* block_carve_aligned(free_block* top, uintptr_t aligned,
+                                 uint64_t total_size) {
+    uint64_t pad = aligned - sizeof(free_block) - (uintptr_t)top;
+    free_block* block = top;
+    if (pad != 0) {
+        block = (free_block*)(aligned - sizeof(free_block));
+        block->size = top->size - pad;
+        block->freed = 0;
+        block->next = NULL;
+        block->prev = NULL;
+        top->size = pad;
+        if (top == heap_tail) {
+            heap_tail = block;
+        }
+        block_release(top);
+    }
+    block_mark(block, 0);
+    block_shrink(block, total_size);
+    total_allocations++;
+    heap_note_peak();
+    return (char*)block + sizeof(free_block);
+}
+
+// Allocate a block of `total_size` bytes whose payload is `offset` bytes
+// past a multiple of `align`, a page or more. A free block that has room
+// for it is used first; otherwise the block is carved from the top of the
+// heap, growing it as needed. Returns the payload or NULL.
+static void* heap_alloc_page_aligned(uint64_t align, uint64_t offset,
+                                     uint64_t total_size) {
+    free_block* fit = bin_find_aligned(align, offset, total_size);
+    if (fit) {
+        bin_remove(fit);
+        return block_carve_aligned(
+            fit, aligned_payload((uintptr_t)fit, align, offset), total_size);
+    }
+
+    free_block* top = heap_tail && heap_tail->freed == 1 ? heap_tail : NULL;
+    uintptr_t start = top ? (uintptr_t)top : (uintptr_t)heap_end;
+    uintptr_t aligned = aligned_payload(start, align, offset);
+    uint64_t pad = aligned - sizeof(free_block) - start;
+    if (!top && pad != 0) {
+        // Grow by the padding first so it becomes the free top block
+        if (!(top = heap_grow(pad))) {
+            return NULL;
+        }
+    }
+
+    top = heap_grow(pad + total_size);
+    if (!top) {
+        return NULL;
+    }
+    bin_remove(top);
+    return block_carve_aligned(top, aligned, total_size);
+}
+
+static void* heap_malloc(uint64_t sz);
+
+// Allocate `sz` bytes at a multiple of `align`, a power of two. The padding
+// in front of the aligned block is split off and released as a free block.
+// Alignments of a page or more go through heap_alloc_page_aligned().
+static void* heap_alloc_aligned(uint64_t align, uint64_t sz) {
+    if (align <= 8) {
+        return malloc(sz);
+    }
+    initialize_heap();
+    uint64_t total_size = ((sz + 7) & ~7) + sizeof(free_block);
+    if (align >= PAGESIZE) {
+        return heap_alloc_page_aligned(align, 0, total_size);
+    }
+
+    void* ptr = heap_malloc(total_size + align + MIN_BLOCK_SIZE);
+    if (!ptr) {
+        return NULL;
+    }
 
-    // Get block header
     free_block* block = (free_block*)((char*)ptr - sizeof(free_block));
-    
-    // Just mark as freed but DO NOT clear next/prev yet
-    block->freed = 1;
-    
-    // app_printf(0, "free: Block at %p marked as freed. Size: %d\n", block, block->size);
+    if ((uintptr_t)ptr % align != 0) {
+        // The padding must be big enough to be a free block
+        uintptr_t aligned = ROUNDUP((uintptr_t)ptr + MIN_BLOCK_SIZE, align);
+        free_block* lead = block;
+        block = (free_block*)(aligned - sizeof(free_block));
+        block->size = lead->size - (aligned - (uintptr_t)ptr);
+        block->freed = 0;
+        block->next = NULL;
+        block->prev = NULL;
+        lead->size = aligned - (uintptr_t)ptr;
+        if (lead == heap_tail) {
+            heap_tail = block;
+        }
+        block_release(lead);
+    }
 
-    // If the block was already in the list, we're done
-    // This handles blocks that were allocated but remain in the list
-    if (block->next || block->prev || block == head) {
-        // app_printf(0, "free: Block already in list, just marked as freed\n");
-        return;
+    block_shrink(block, total_size);
+    return (char*)block + sizeof(free_block);
+}
+
+
+// memalign(align, sz)
+//    Allocate `sz` bytes aligned to `align`, which must be a power of two.
+void* memalign(uint64_t align, uint64_t sz) {
+    if (sz == 0 || align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
     }
+    return heap_alloc_aligned(align, sz);
+}
 
-    // Find position to insert block
-    free_block* current = head;
-    free_block* prev = NULL;
+void* aligned_alloc(uint64_t align, uint64_t sz) {
+    return memalign(align, sz);
+}
 
-    while (current && current < block) {
-        prev = current;
-        current = current->next;
+int posix_memalign(void** memptr, uint64_t align, uint64_t sz) {
+    if (align < sizeof(void*) || (align & (align - 1)) != 0) {
+        return EINVAL;
+    }
+    void* ptr = sz ? heap_alloc_aligned(align, sz) : NULL;
+    if (sz && !ptr) {
+        return ENOMEM;
     }
+    *memptr = ptr;
+    return 0;
+}
 
-    // Insert block into list
-    if (prev) {
-        prev->next = block;
-        block->prev = prev;
+
+// Large objects, and the heap_info() buffers, live outside the heap in
+// page-granular regions below the stack. Each region is mapped with
+// sys_page_alloc_range() when created and unmapped with
+// sys_page_free_range() as soon as it is released, so a long-lived large
+// block never pins the top of the heap. New regions are carved top-down
+// from `region_floor`, and heap_grow() stops short of it. Released regions
+// at the floor raise it again; others become holes, kept sorted by address
+// and merged with their neighbors, that later regions are carved from
+// first-fit. If the hole list is full a hole is forgotten: its pages are
+// still returned, only its address space is lost.
+#define LARGE_THRESHOLD 0x20000         // 128 KiB: smallest large object
+#define NREGION_HOLES 32
+
+typedef struct region_hole {
+    uintptr_t start;
+    uintptr_t end;
+} region_hole;
+
+static region_hole region_holes[NREGION_HOLES];
+static int region_nholes = 0;
+
+// A large object starts with an ordinary block header whose size is the
+// whole region. Live large objects are linked through `next`/`prev`.
+static free_block* large_list = NULL;
+static long large_bytes = 0;
+static int large_allocs = 0;
+
+// region_map(len)
+//    Map a region of `len` bytes, a multiple of PAGESIZE. Returns its
+//    address, or 0 if there is no room or no memory.
+static uintptr_t region_map(size_t len) {
+    initialize_heap();
+
+    int hole = 0;
+    while (hole < region_nholes
+           && region_holes[hole].end - region_holes[hole].start < len) {
+        hole++;
+    }
+    uintptr_t heap_top = ROUNDUP((uintptr_t)heap_end, PAGESIZE);
+    uintptr_t addr;
+    if (hole < region_nholes) {
+        addr = region_holes[hole].start;
+    } else if (heap_top <= region_floor && len <= region_floor - heap_top) {
+        addr = region_floor - len;
     } else {
-        head = block;
-        block->prev = NULL;
+        return 0;
     }
 
-    if (current) {
-        current->prev = block;
-        block->next = current;
+    if (sys_page_alloc_range((void*)addr, len, PTE_W) != (long)(len / PAGESIZE)) {
+        sys_page_free_range((void*)addr, len);
+        return 0;
+    }
+    if (hole < region_nholes) {
+        region_holes[hole].start += len;
+        if (region_holes[hole].start == region_holes[hole].end) {
+            region_nholes--;
+            memmove(&region_holes[hole], &region_holes[hole + 1],
+                    (region_nholes - hole) * sizeof(region_hole));
+        }
     } else {
-        block->next = NULL;
+        region_floor = addr;
     }
+    return addr;
+}
 
-    // Try to coalesce with next block
-    if (block->next && block->next->freed && 
-        (char*)block + block->size == (char*)block->next) {
-        // app_printf(0, "free: Coalescing with next block\n");
-        block->size += block->next->size;
-        block->next = block->next->next;
-        if (block->next) {
-            block->next->prev = block;
+// region_unmap(addr, len)
+//    Give the region at `addr` back to the kernel and recycle its address
+//    space.
+static void region_unmap(uintptr_t addr, size_t len) {
+    sys_page_free_range((void*)addr, len);
+    uintptr_t end = addr + len;
+
+    if (addr == region_floor) {
+        region_floor = end;
+        // Holes are all above the floor; the lowest may now touch it
+        if (region_nholes && region_holes[0].start == region_floor) {
+            region_floor = region_holes[0].end;
+            region_nholes--;
+            memmove(&region_holes[0], &region_holes[1],
+                    region_nholes * sizeof(region_hole));
         }
+        return;
     }
 
-    // Try to coalesce with previous block
-    if (block->prev && block->prev->freed && 
-        (char*)block->prev + block->prev->size == (char*)block) {
-        // app_printf(0, "free: Coalescing with previous block\n");
-        block->prev->size += block->size;
-        block->prev->next = block->next;
-        if (block->next) {
-            block->next->prev = block->prev;
+    int i = 0;
+    while (i < region_nholes && region_holes[i].end < addr) {
+        i++;
+    }
+    if (i < region_nholes && region_holes[i].end == addr) {
+        region_holes[i].end = end;
+        if (i + 1 < region_nholes && region_holes[i + 1].start == end) {
+            region_holes[i].end = region_holes[i + 1].end;
+            region_nholes--;
+            memmove(&region_holes[i + 1], &region_holes[i + 2],
+                    (region_nholes - i - 1) * sizeof(region_hole));
         }
+    } else if (i < region_nholes && region_holes[i].start == end) {
+        region_holes[i].start = addr;
+    } else if (region_nholes < NREGION_HOLES) {
+        memmove(&region_holes[i + 1], &region_holes[i],
+                (region_nholes - i) * sizeof(region_hole));
+        region_holes[i].start = addr;
+        region_holes[i].end = end;
+        region_nholes++;
     }
+}
 
-    // app_printf(0, "free: Final block list:\n");
-    current = head;
-    while (current) {
-        // app_printf(0, "  Block at %p: size=%d freed=%d next=%p prev=%p\n",
-        //           current, current->size, current->freed, 
-        //           current->next, current->prev);
-        current = current->next;
+static int large_contains(void* ptr) {
+    return (uintptr_t)ptr >= region_floor && (uintptr_t)ptr < region_top;
+}
+
+static void* large_alloc(uint64_t sz) {
+    if (sz > UINT64_MAX - sizeof(free_block) - PAGESIZE) {
+        return NULL;
+    }
+    size_t len = ROUNDUP(sz + sizeof(free_block), PAGESIZE);
+    free_block* block = (free_block*)region_map(len);
+    if (!block) {
+        return NULL;
+    }
+    block->size = len;
+    block->freed = 0;
+    block->prev_freed = 0;
+    block->prev = NULL;
+    block->next = large_list;
+    if (large_list) {
+        large_list->prev = block;
+    }
+    large_list = block;
+    large_bytes += len;
+    large_allocs++;
+    total_allocations++;
+    return (char*)block + sizeof(free_block);
+}
+
+static void large_free(free_block* block) {
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        large_list = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    large_bytes -= block->size;
+    large_allocs--;
+    region_unmap((uintptr_t)block, block->size);
+}
+
+
+// Small blocks passed to free() are pushed unmerged onto a per-size LIFO
+// fast bin (the tcache), and the next malloc of that size pops them back
+// off. Cached blocks still look allocated to the rest of the heap;
+// tcache_flush() hands them back to the bins every TCACHE_FLUSH_INTERVAL
+// frees and before defrag() or heap_info() looks at the heap.
+#define TCACHE_MAX_SIZE 128             // largest cached payload, in bytes
+#define TCACHE_NBINS (TCACHE_MAX_SIZE / 8 + 1)
+#define TCACHE_DEFAULT_COUNT 16         // blocks per fast bin
+#define TCACHE_FLUSH_INTERVAL 4096
+#define DEFRAG_STEP_BUDGET 64           // blocks defrag_step() visits per flush
+
+static free_block* tcache[TCACHE_NBINS];
+static int tcache_count[TCACHE_NBINS];
+static int tcache_capacity = TCACHE_DEFAULT_COUNT;
+static int tcache_frees = 0;
+
+static void tcache_flush_bin(int idx, int keep) {
+    while (tcache_count[idx] > keep) {
+        free_block* block = tcache[idx];
+        tcache[idx] = block->next;
+        tcache_count[idx]--;
+        cached_bytes -= block->size;
+        block->next = NULL;
+        block_release(block);
+    }
+}
+
+void tcache_flush(void) {
+    for (int idx = 0; idx < TCACHE_NBINS; idx++) {
+        tcache_flush_bin(idx, 0);
+    }
+    tcache_frees = 0;
+}
+
+// tcache_set_capacity(count)
+//    Set how many blocks each fast bin may hold. 0 disables the tcache.
+void tcache_set_capacity(int count) {
+    tcache_capacity = count > 0 ? count : 0;
+    for (int idx = 0; idx < TCACHE_NBINS; idx++) {
+        tcache_flush_bin(idx, tcache_capacity);
+    }
+}
+
+
+
+void free(void* ptr) {
+    if (!ptr) {
+        // app_printf(0, "free: Null pointer passed, nothing to free.\n");
+        return;
+    }
+
+    total_allocations--;
+    // app_printf(0, "free: Pointer %p received for freeing. Total allocations now: %d\n", 
+    //            ptr, total_allocations);
+
+    // Get block header
+    free_block* block = (free_block*)((char*)ptr - sizeof(free_block));
+    if (large_contains(block)) {
+        large_free(block);
+        return;
+    }
+
+    // app_printf(0, "free: Block at %p marked as freed. Size: %d\n", block, block->size);
+
+    uint64_t payload = block->size - sizeof(free_block);
+    if (payload <= TCACHE_MAX_SIZE
+        && tcache_count[payload >> 3] < tcache_capacity) {
+        block->next = tcache[payload >> 3];
+        tcache[payload >> 3] = block;
+        tcache_count[payload >> 3]++;
+        cached_bytes += block->size;
+    } else {
+        block_release(block);
+    }
+
+    if (++tcache_frees >= TCACHE_FLUSH_INTERVAL) {
+        tcache_flush();
+        defrag_step(DEFRAG_STEP_BUDGET);
     }
 }
 
@@ -122,78 +786,70 @@ void* malloc(uint64_t sz) {
     if (sz == 0) {
         return NULL; // Do not allocate zero-sized memory
     }
+    if (sz >= LARGE_THRESHOLD) {
+        void* ptr = large_alloc(sz);
+        if (ptr) {
+            return ptr;
+        }
+        // Out of region space; the heap may still have room
+    }
+    return heap_malloc(sz);
+}
+
+// heap_malloc(sz)
+//    Allocate `sz` bytes, which must not be 0, from the heap proper.
+static void* heap_malloc(uint64_t sz) {
+    initialize_heap();
 
     // Align size to 8 bytes
     uint64_t align_size = (sz + 7) & ~7; // Round up to the nearest multiple of 8
     uint64_t total_size = align_size + sizeof(free_block);
 
-    // Find the best-fitting free block
-    free_block* best_fit = NULL;
-    free_block* current = head;
-    uint64_t min_size_diff = UINT64_MAX;
+    // Reuse a cached block of exactly this size if there is one
+    if (align_size <= TCACHE_MAX_SIZE && tcache[align_size >> 3]) {
+        free_block* block = tcache[align_size >> 3];
+        tcache[align_size >> 3] = block->next;
+        tcache_count[align_size >> 3]--;
+        cached_bytes -= block->size;
+        block->next = NULL;
+        total_allocations++;
+        heap_note_peak();
+        return (char*)block + sizeof(free_block);
+    }
 
-    while (current) {
-        if (current->freed == 1 && current->size >= total_size) {
-            uint64_t size_diff = current->size - total_size;
-            if (size_diff < min_size_diff) {
-                min_size_diff = size_diff;
-                best_fit = current;
-            }
-        }
-        current = current->next;
+    // Find a fitting free block, or else request more memory from the
+    // system
+    free_block* best_fit = bin_find(total_size);
+    if (!best_fit) {
+        best_fit = heap_grow(total_size);
     }
 
     // If a suitable block was found, allocate from it
     if (best_fit) {
+        bin_remove(best_fit);
+
         // If there's enough space left in the block, split it
         if (best_fit->size >= total_size + sizeof(free_block) + 8) {
             free_block* new_block = (free_block*)((char*)best_fit + total_size);
             new_block->size = best_fit->size - total_size;
-            new_block->freed = 1;
-            new_block->next = best_fit->next;
-            new_block->prev = best_fit;
+            new_block->prev_freed = 0;
+            block_mark(new_block, 1);
+            bin_insert(new_block);
 
             best_fit->size = total_size;
-            best_fit->next = new_block;
-            if (new_block->next) {
-                new_block->next->prev = new_block;
+            if (best_fit == heap_tail) {
+                heap_tail = new_block;
             }
         }
 
         // Mark the block as not free and return the usable memory region
-        best_fit->freed = 0;
+        block_mark(best_fit, 0);
         total_allocations++;
+        heap_note_peak();
         return (char*)best_fit + sizeof(free_block);
     }
 
-    // If no suitable block was found, request more memory from the system
-    void* new_block_addr = sbrk(total_size);
-    if (new_block_addr == (void*)-1) {
-        return NULL; // Failed to allocate memory
-    }
-
-    // Initialize the new block
-    free_block* new_block = (free_block*)new_block_addr;
-    new_block->size = total_size;
-    new_block->freed = 0;
-    new_block->next = NULL;
-    new_block->prev = NULL;
-
-    // Add the new block to the free list
-    if (head == NULL) {
-        head = new_block;
-    } else {
-        // Traverse to the end of the list and append the new block
-        current = head;
-        while (current->next) {
-            current = current->next;
-        }
-        current->next = new_block;
-        new_block->prev = current;
-    }
-
-    total_allocations++;
-    return (char*)new_block + sizeof(free_block);
+    return NULL; // Failed to allocate memory
 }
 
 
@@ -228,8 +884,33 @@ void * realloc(void * ptr, uint64_t sz) {
     }
 
     free_block* block = (free_block*)((char*)ptr - sizeof(free_block));
-    if (block->size >= sz + sizeof(free_block)) {
-        return ptr; // Block is already large enough
+    uint64_t total_size = ((sz + 7) & ~7) + sizeof(free_block);
+    if (block->size >= total_size) {
+        // Block is already large enough; give back any excess
+        if (!large_contains(block)) {
+            block_shrink(block, total_size);
+        }
+        return ptr;
+    }
+
+    // Grow in place into a free block right above this one. At the top of
+    // the heap, extend the heap instead.
+    free_block* next = block_next(block);
+    free_block* room = NULL;
+    if (large_contains(block)) {
+        // Large objects always move to a new region
+    } else if (next && next->freed == 1 && block->size + next->size >= total_size) {
+        room = next;
+    } else if (block == heap_tail || (next == heap_tail && next->freed == 1)) {
+        room = heap_grow(total_size - block->size);
+    }
+    if (room) {
+        bin_remove(room);
+        block_absorb(block, room);
+        block_mark(block, 0);
+        block_shrink(block, total_size);
+        heap_note_peak();
+        return ptr;
     }
 
     void* new_ptr = malloc(sz); // Allocate a new block
@@ -241,53 +922,377 @@ void * realloc(void * ptr, uint64_t sz) {
 }
 
 
+// defrag_step(budget)
+//    Visit up to `budget` heap blocks, merging adjacent free blocks, and
+//    return the number of blocks merged away. The walk resumes where the
+//    last call stopped and wraps around to the bottom of the heap after
+//    reaching the top, so each call is a short, bounded pause. free()
+//    already merges blocks with their free neighbors, so this only catches
+//    what is left over; free() takes a step of DEFRAG_STEP_BUDGET blocks
+//    each time it flushes the tcache.
+int defrag_step(int budget) {
+    if (!heap_start) {
+        return 0;
+    }
+    free_block* current = defrag_cursor ? defrag_cursor : block_first();
+    int merged = 0;
+    while (current && budget-- > 0) {
+        free_block* next = block_next(current);
+        if (current->freed == 1 && next && next->freed == 1) {
+            bin_remove(current);
+            bin_remove(next);
+            block_absorb(current, next);
+            block_mark(current, 1);
+            bin_insert(current);
+            merged++;
+            // Stay on current block to check for more merges
+        } else {
+            current = next;
+        }
+    }
+    defrag_cursor = current;
+    return merged;
+}
+
+// defrag()
+//    Hand every tcache block back to the bins and coalesce the whole heap.
 void defrag() {
-    if (!head) {
+    if (!heap_start) {
         return;
     }
+    tcache_flush();
+    defrag_cursor = NULL;
+    do {
+        defrag_step(DEFRAG_STEP_BUDGET);
+    } while (defrag_cursor);
+}
 
-    // app_printf(0, "Starting defrag\n");
-    // print_free_chunks("before defrag");
 
-    int did_merge;
-    do {
-        did_merge = 0;
-        free_block* current = head;
-        
-        while (current && current->next) {
-            free_block* next = current->next;
-            
-            if (current->freed && next->freed) {
-                char* current_end = (char*)current + current->size;
-                
-                // app_printf(0, "Checking blocks: current=%p (size=%d) next=%p (size=%d)\n",
-                //           current, current->size, next, next->size);
-                // app_printf(0, "  current_end=%p\n", current_end);
-                
-                if (current_end == (char*)next) {
-                    // app_printf(0, "  Merging blocks! New size will be %d\n", 
-                    //          current->size + next->size);
-                    current->size += next->size;
-                    current->next = next->next;
-                    if (next->next) {
-                        next->next->prev = current;
-                    }
-                    did_merge = 1;
-                    // Stay on current block to check for more merges
-                } else {
-                    // app_printf(0, "  Blocks not adjacent\n");
-                    current = next;
-                }
-            } else {
-                current = next;
+
+
+// Arenas hand out memory by bumping a pointer through chunks taken from the
+// heap, and give it all back at once with arena_reset() or
+// arena_destroy(). The arena descriptor lives at the start of its first
+// chunk. arena_reset() keeps every chunk for reuse.
+#define ARENA_DEFAULT_CHUNK (PAGESIZE - sizeof(free_block) - sizeof(arena_chunk))
+#define ARENA_ALIGN 8
+
+typedef struct arena_chunk {
+    struct arena_chunk* next;
+    uint64_t size;               // usable bytes after this header
+    uint64_t used;               // bytes handed out from this chunk
+} arena_chunk;
+
+struct arena {
+    arena_chunk* chunks;         // first chunk, which holds this descriptor
+    arena_chunk* current;        // chunk being bumped into
+    uint64_t chunk_size;
+    uint64_t used;               // bytes handed out since the last reset
+};
+
+static long arena_reserved = 0;   // totals over all arenas
+static long arena_used = 0;
+
+static arena_chunk* arena_chunk_new(uint64_t size) {
+    arena_chunk* chunk = (arena_chunk*)malloc(sizeof(arena_chunk) + size);
+    if (!chunk) {
+        return NULL;
+    }
+    free_block* block = (free_block*)((char*)chunk - sizeof(free_block));
+    block->freed = BLOCK_ARENA;
+    total_allocations--;
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    arena_reserved += block->size;
+    return chunk;
+}
+
+static void arena_chunk_free(arena_chunk* chunk) {
+    free_block* block = (free_block*)((char*)chunk - sizeof(free_block));
+    arena_reserved -= block->size;
+    block->freed = 0;
+    total_allocations++;
+    free(chunk);
+}
+
+// arena_create(chunk_size)
+//    Create an arena that grows `chunk_size` bytes at a time (0 picks a
+//    default). Returns NULL if the heap is exhausted.
+arena* arena_create(uint64_t chunk_size) {
+    if (chunk_size == 0) {
+        chunk_size = ARENA_DEFAULT_CHUNK;
+    }
+    chunk_size = (chunk_size + 7) & ~7;
+    arena_chunk* chunk = arena_chunk_new(sizeof(arena) + chunk_size);
+    if (!chunk) {
+        return NULL;
+    }
+
+    arena* a = (arena*)(chunk + 1);
+    chunk->used = sizeof(arena);
+    a->chunks = chunk;
+    a->current = chunk;
+    a->chunk_size = chunk_size;
+    a->used = 0;
+    return a;
+}
+
+// arena_alloc_aligned(a, sz, align)
+//    Allocate `sz` bytes from arena `a`, aligned to `align`, which must be a
+//    power of two. Runs in constant time unless a new chunk is needed.
+void* arena_alloc_aligned(arena* a, uint64_t sz, uint64_t align) {
+    if (!a || sz == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align < ARENA_ALIGN) {
+        align = ARENA_ALIGN;
+    }
+
+    arena_chunk* chunk = a->current;
+    uintptr_t base = (uintptr_t)(chunk + 1);
+    uintptr_t p = ROUNDUP(base + chunk->used, align);
+
+    if (p + sz > base + chunk->size) {
+        // Move on to the next chunk kept by arena_reset(), or add one
+        uint64_t need = sz + align - ARENA_ALIGN;
+        if (!chunk->next || chunk->next->size < need) {
+            arena_chunk* fresh = arena_chunk_new(
+                need > a->chunk_size ? need : a->chunk_size);
+            if (!fresh) {
+                return NULL;
             }
+            fresh->next = chunk->next;
+            chunk->next = fresh;
         }
-    } while (did_merge);
+        chunk = chunk->next;
+        chunk->used = 0;
+        a->current = chunk;
+        base = (uintptr_t)(chunk + 1);
+        p = ROUNDUP(base, align);
+    }
 
-    // app_printf(0, "Defrag complete\n");
-    // print_free_chunks("after defrag");
+    uint64_t used = p + sz - base;
+    a->used += used - chunk->used;
+    arena_used += used - chunk->used;
+    chunk->used = used;
+    return (void*)p;
 }
 
+void* arena_alloc(arena* a, uint64_t sz) {
+    return arena_alloc_aligned(a, sz, ARENA_ALIGN);
+}
+
+// arena_reset(a)
+//    Free everything allocated from `a` at once. The arena keeps its chunks.
+void arena_reset(arena* a) {
+    if (!a) {
+        return;
+    }
+    arena_used -= a->used;
+    a->used = 0;
+    a->current = a->chunks;
+    a->chunks->used = sizeof(arena);
+}
+
+// arena_destroy(a)
+//    Free everything allocated from `a` and return its chunks to the heap.
+void arena_destroy(arena* a) {
+    if (!a) {
+        return;
+    }
+    arena_used -= a->used;
+    arena_chunk* first = a->chunks;
+    arena_chunk* chunk = first->next;
+    while (chunk) {
+        arena_chunk* next = chunk->next;
+        arena_chunk_free(chunk);
+        chunk = next;
+    }
+    arena_chunk_free(first);
+}
+
+
+
+// Pools hand out fixed-size objects from page-sized, page-aligned slabs
+// taken from the heap. A slab is one heap block that fills its page
+// exactly: the block header sits at the page boundary and the slab
+// descriptor right after it, so a slab costs one page and no padding. Free
+// objects are linked through their first word, so objects carry no
+// header. Each slab keeps a bitmap of its live objects, which lets
+// heap_info() list them without chasing free lists.
+#define SLAB_SIZE PAGESIZE
+#define SLAB_PAYLOAD (SLAB_SIZE - sizeof(free_block))
+#define SLAB_MAX_OBJECTS (SLAB_SIZE / 8)
+
+typedef struct slab {
+    pool* owner;
+    struct slab* next;           // in the owner's partial or full list
+    struct slab* prev;
+    void* free_list;             // free objects in this slab
+    int nfree;
+    uint64_t live[SLAB_MAX_OBJECTS / 64];
+} slab;
+
+struct pool {
+    uint64_t obj_size;           // object size, rounded up to the alignment
+    uint64_t first;              // offset of the first object from the
+                                 // slab descriptor
+    int nobjs;                   // objects per slab
+    slab* partial;               // slabs with free objects
+    slab* full;                  // slabs with none
+};
+
+static void slab_push(slab** list, slab* s) {
+    s->prev = NULL;
+    s->next = *list;
+    if (*list) {
+        (*list)->prev = s;
+    }
+    *list = s;
+}
+
+static void slab_unlink(slab** list, slab* s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        *list = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+}
+
+static slab* slab_new(pool* p) {
+    initialize_heap();
+    slab* s = (slab*)heap_alloc_page_aligned(SLAB_SIZE, sizeof(free_block),
+                                             SLAB_SIZE);
+    if (!s) {
+        return NULL;
+    }
+    free_block* block = (free_block*)((char*)s - sizeof(free_block));
+    block->freed = BLOCK_SLAB;
+    total_allocations--;
+
+    s->owner = p;
+    s->free_list = NULL;
+    s->nfree = p->nobjs;
+    memset(s->live, 0, sizeof(s->live));
+    for (int i = p->nobjs - 1; i >= 0; i--) {
+        void** obj = (void**)((char*)s + p->first + i * p->obj_size);
+        *obj = s->free_list;
+        s->free_list = obj;
+    }
+    slab_push(&p->partial, s);
+    return s;
+}
+
+static void slab_free(slab* s) {
+    free_block* block = (free_block*)((char*)s - sizeof(free_block));
+    block->freed = 0;
+    total_allocations++;
+    free(s);
+}
+
+// pool_create(obj_size, align)
+//    Create a pool of `obj_size`-byte objects aligned to `align`, a power of
+//    two. Returns NULL if an object does not fit in a slab.
+pool* pool_create(uint64_t obj_size, uint64_t align) {
+    if ((align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align < 8) {
+        align = 8;
+    }
+    if (obj_size < 8) {
+        obj_size = 8;
+    }
+    obj_size = ROUNDUP(obj_size, align);
+    // Objects are aligned within the page, which starts with a block header
+    uint64_t first = ROUNDUP(sizeof(free_block) + sizeof(slab), align)
+        - sizeof(free_block);
+    if (first + obj_size > SLAB_PAYLOAD) {
+        return NULL;
+    }
+
+    pool* p = (pool*)malloc(sizeof(pool));
+    if (!p) {
+        return NULL;
+    }
+    p->obj_size = obj_size;
+    p->first = first;
+    p->nobjs = (SLAB_PAYLOAD - first) / obj_size;
+    p->partial = NULL;
+    p->full = NULL;
+    return p;
+}
+
+void* pool_alloc(pool* p) {
+    if (!p) {
+        return NULL;
+    }
+    slab* s = p->partial;
+    if (!s && !(s = slab_new(p))) {
+        return NULL;
+    }
+
+    void** obj = (void**)s->free_list;
+    s->free_list = *obj;
+    int i = ((char*)obj - (char*)s - p->first) / p->obj_size;
+    s->live[i >> 6] |= 1ULL << (i & 63);
+    if (--s->nfree == 0) {
+        slab_unlink(&p->partial, s);
+        slab_push(&p->full, s);
+    }
+    total_allocations++;
+    return obj;
+}
+
+void pool_free(pool* p, void* ptr) {
+    if (!p || !ptr) {
+        return;
+    }
+    slab* s = (slab*)(ROUNDDOWN((uintptr_t)ptr, SLAB_SIZE)
+                      + sizeof(free_block));
+    assert(s->owner == p);
+
+    int i = ((char*)ptr - (char*)s - p->first) / p->obj_size;
+    s->live[i >> 6] &= ~(1ULL << (i & 63));
+    *(void**)ptr = s->free_list;
+    s->free_list = ptr;
+    total_allocations--;
+
+    if (++s->nfree == 1) {
+        slab_unlink(&p->full, s);
+        slab_push(&p->partial, s);
+    }
+    // A slab of one object is full and empty in turn, so check separately.
+    // Keep an empty slab only if no other slab has room.
+    if (s->nfree == p->nobjs && (p->partial != s || s->next)) {
+        slab_unlink(&p->partial, s);
+        slab_free(s);
+    }
+}
+
+// pool_destroy(p)
+//    Free every object in `p` and return its slabs to the heap.
+void pool_destroy(pool* p) {
+    if (!p) {
+        return;
+    }
+    slab* lists[2] = { p->partial, p->full };
+    for (int l = 0; l < 2; l++) {
+        slab* s = lists[l];
+        while (s) {
+            slab* next = s->next;
+            total_allocations -= p->nobjs - s->nfree;
+            slab_free(s);
+            s = next;
+        }
+    }
+    free(p);
+}
 
 
 
@@ -355,89 +1360,178 @@ void mergeSort(long arr[], int left, int right) {
     }
 }
 
+// heap_stats(stats)
+//    Fill `stats` from the running counters. Takes constant time, apart from
+//    an occasional rescan of the largest bin, so it is safe to call often.
+void heap_stats(heap_stats_struct* stats) {
+    if (!stats) {
+        return;
+    }
+    stats->heap_size = (char*)heap_end - (char*)heap_start;
+    stats->in_use = heap_in_use();
+    stats->free_space = free_bytes;
+    stats->cached = cached_bytes;
+    stats->peak_in_use = peak_in_use;
+    stats->sbrk_bytes = sbrk_bytes;
+    stats->largest_free_chunk = bin_largest();
+    stats->large_bytes = large_bytes;
+    stats->large_allocs = large_allocs;
+    stats->num_allocs = total_allocations;
+    for (int idx = 0; idx < NBINS; idx++) {
+        stats->free_blocks[idx] = bin_count[idx];
+    }
+}
+
+
+// heap_info() collects its results into buffers in a region (see
+// region_map()), so inspecting the heap never allocates from it. The region
+// holds four arrays of equal capacity: sizes and pointers, and spares for
+// sorting.
+#define INFO_ENTRY_SIZE (2 * (sizeof(long) + sizeof(void*)))
+
+static uintptr_t info_base = 0;
+static size_t info_len = 0;
+
+// Make room for `n` entries in each heap_info buffer. Returns the capacity,
+// or -1 if no region that big can be mapped.
+static long info_reserve(long n) {
+    long cap = info_len / INFO_ENTRY_SIZE;
+    if (cap >= n) {
+        return cap;
+    }
+
+    // The buffers hold nothing between calls, so grow by replacing them.
+    // Double the request so repeated calls on a growing heap stay cheap.
+    if (info_base) {
+        region_unmap(info_base, info_len);
+        info_base = 0;
+        info_len = 0;
+    }
+    size_t want = ROUNDUP(2 * n * INFO_ENTRY_SIZE, PAGESIZE);
+    if (!(info_base = region_map(want))) {
+        want = ROUNDUP(n * INFO_ENTRY_SIZE, PAGESIZE);
+        if (!(info_base = region_map(want))) {
+            return -1;
+        }
+    }
+    info_len = want;
+    return info_len / INFO_ENTRY_SIZE;
+}
+
+// Stable merge sort of `n` (size, pointer) pairs by size, largest first.
+// Works bottom-up, ping-ponging between the arrays and the spares, so it
+// needs no recursion and no stack space; `*size` and `*ptr` are updated to
+// point at whichever pair of arrays ends up holding the result.
+static void sort_by_size(long** size, void*** ptr,
+                         long* spare_size, void** spare_ptr, long n) {
+    long* from_size = *size;
+    void** from_ptr = *ptr;
+    for (long width = 1; width < n; width *= 2) {
+        for (long left = 0; left < n; left += 2 * width) {
+            long mid = left + width < n ? left + width : n;
+            long right = left + 2 * width < n ? left + 2 * width : n;
+            long i = left, j = mid, k = left;
+            while (i < mid && j < right) {
+                if (from_size[i] >= from_size[j]) {
+                    spare_size[k] = from_size[i];
+                    spare_ptr[k++] = from_ptr[i++];
+                } else {
+                    spare_size[k] = from_size[j];
+                    spare_ptr[k++] = from_ptr[j++];
+                }
+            }
+            while (i < mid) {
+                spare_size[k] = from_size[i];
+                spare_ptr[k++] = from_ptr[i++];
+            }
+            while (j < right) {
+                spare_size[k] = from_size[j];
+                spare_ptr[k++] = from_ptr[j++];
+            }
+        }
+        long* tmp_size = from_size;
+        void** tmp_ptr = from_ptr;
+        from_size = spare_size;
+        from_ptr = spare_ptr;
+        spare_size = tmp_size;
+        spare_ptr = tmp_ptr;
+    }
+    *size = from_size;
+    *ptr = from_ptr;
+}
+
 int heap_info(heap_info_struct* info) {
     if (!info) {
         return -1;
     }
+    tcache_flush();
     // print_free_chunks("before collecting info"); 
 
-    // First pass: count allocations and gather free space info 
-    int counted_allocs = 0;  // separate counter for debugging
+    // Use the global count since it's working
+    info->num_allocs = total_allocations;
+    info->size_array = NULL;
+    info->ptr_array = NULL;
     info->free_space = 0;
     info->largest_free_chunk = 0;
+    // Arena chunks are neither allocations nor free space
+    info->arena_reserved = arena_reserved;
+    info->arena_used = arena_used;
 
-    free_block* current = head;
-    //app_printf(0, "Starting list traversal. head=%p\n", head);
-    
+    long n = info->num_allocs;
+    long cap = 0;
+    if (n > 0 && (cap = info_reserve(n)) < 0) {
+        return -1;
+    }
+    long* size_buffer = (long*)info_base;
+    void** ptr_buffer = (void**)(size_buffer + cap);
+    long* spare_size = (long*)(ptr_buffer + cap);
+    void** spare_ptr = (void**)(spare_size + cap);
+
+    // One pass: gather free space info and fill the buffers with allocated
+    // blocks
+    free_block* current = block_first();
+    long b = 0;
     while (current) {
-        if (current->freed) {
+        if (current->freed == 1) {
             info->free_space += current->size;
             if ((long)current->size > info->largest_free_chunk) {
                 info->largest_free_chunk = (long)current->size;
-                // app_printf(0, "Found larger free chunk: %ld at %p\n", 
-                //           info->largest_free_chunk, current);
             }
-        } else {
-            counted_allocs++;
+        } else if (current->freed == 0 && b < n) {
+            // Store info about allocated block
+            size_buffer[b] = (long)current->size - sizeof(free_block);  // Return actual usable size
+            ptr_buffer[b] = (void*)((char*)current + sizeof(free_block));
+            b++;
+        } else if (current->freed == BLOCK_SLAB) {
+            // Report each live pool object
+            slab* s = (slab*)((char*)current + sizeof(free_block));
+            for (int w = 0; w < SLAB_MAX_OBJECTS / 64; w++) {
+                for (uint64_t bits = s->live[w]; bits && b < n; bits &= bits - 1) {
+                    int i = (w << 6) + __builtin_ctzll(bits);
+                    size_buffer[b] = (long)s->owner->obj_size;
+                    ptr_buffer[b] = (char*)s + s->owner->first
+                        + i * s->owner->obj_size;
+                    b++;
+                }
+            }
         }
-        current = current->next;
+        current = block_next(current);
     }
-
-
-    // app_printf(0, "List traversal found %d allocations, global count is %d\n", 
-    //           counted_allocs, total_allocations);
-    
-    // Use the global count since it's working
-    info->num_allocs = total_allocations;
-    if (info->num_allocs == 0) {
-        info->size_array = NULL;
-        info->ptr_array = NULL;
-        return 0;
+    for (current = large_list; current && b < n; current = current->next) {
+        if (current->freed == 0) {
+            size_buffer[b] = (long)current->size - sizeof(free_block);
+            ptr_buffer[b] = (void*)((char*)current + sizeof(free_block));
+            b++;
+        }
     }
     //  app_printf(0, "heap_info results: allocations=%d, free_space=%ld, largest_chunk=%ld\n",
     //            info->num_allocs, info->free_space, info->largest_free_chunk);
-    // Instead of using malloc, use a pre-allocated buffer or a dedicated region
-    // Assuming we have a static buffer or can use sbrk directly:
-    static long size_buffer[1024];  // Adjust size as needed
-    static void* ptr_buffer[1024];  // Adjust size as needed
 
-    
-    if (info->num_allocs > 1024) {  // Or whatever size you choose
-        return -1;
+    if (n == 0) {
+        return 0;
     }
-
+    sort_by_size(&size_buffer, &ptr_buffer, spare_size, spare_ptr, n);
     info->size_array = size_buffer;
     info->ptr_array = ptr_buffer;
-
-    // Second pass: fill arrays with allocated blocks
-    current = head;
-    int b = 0;
-    while (current) {
-        if (current->freed == 0) {
-            // Store info about allocated block
-            info->size_array[b] = (long)current->size - sizeof(free_block);  // Return actual usable size
-            info->ptr_array[b] = (void*)((char*)current + sizeof(free_block));
-            b++;
-        }
-        current = current->next;
-    }
-
-    // Bubble sort instead of merge sort (simpler and we're dealing with small arrays)
-    for (int i = 0; i < info->num_allocs - 1; i++) {
-        for (int j = 0; j < info->num_allocs - i - 1; j++) {
-            if (info->size_array[j] < info->size_array[j + 1]) {
-                // Swap sizes
-                long temp_size = info->size_array[j];
-                info->size_array[j] = info->size_array[j + 1];
-                info->size_array[j + 1] = temp_size;
-                
-                // Swap pointers
-                void* temp_ptr = info->ptr_array[j];
-                info->ptr_array[j] = info->ptr_array[j + 1];
-                info->ptr_array[j + 1] = temp_ptr;
-            }
-        }
-    }
-
     return 0;
 }
@@ -0,0 +1,68 @@
+#ifndef WEENSYOS_MALLOC_H
+#define WEENSYOS_MALLOC_H
+#include "lib.h"
+#include "process.h"
+
+void* malloc(uint64_t numbytes);
+void* calloc(uint64_t num, uint64_t sz);
+void* realloc(void* ptr, uint64_t sz);
+void free(void* firstbyte);
+void defrag();
+int defrag_step(int budget);
+
+void* memalign(uint64_t align, uint64_t sz);
+void* aligned_alloc(uint64_t align, uint64_t sz);
+int posix_memalign(void** memptr, uint64_t align, uint64_t sz);
+
+void tcache_flush(void);
+void tcache_set_capacity(int count);
+
+typedef struct arena arena;
+arena* arena_create(uint64_t chunk_size);
+void* arena_alloc(arena* a, uint64_t sz);
+void* arena_alloc_aligned(arena* a, uint64_t sz, uint64_t align);
+void arena_reset(arena* a);
+void arena_destroy(arena* a);
+
+typedef struct pool pool;
+pool* pool_create(uint64_t obj_size, uint64_t align);
+void* pool_alloc(pool* p);
+void pool_free(pool* p, void* ptr);
+void pool_destroy(pool* p);
+
+typedef struct heap_info_struct {
+    int num_allocs;
+    long* size_array;
+    void** ptr_array;
+    int free_space;
+    int largest_free_chunk;
+    long arena_reserved;         // heap bytes held by arena chunks
+    long arena_used;             // bytes of those handed out
+} heap_info_struct;
+
+int heap_info(heap_info_struct* info);
+
+// Size classes of the free-block bins: NSMALLBINS exact sizes, each a
+// multiple of 8 bytes, then NLARGEBINS power-of-two ranges.
+#define NSMALLBINS 64
+#define NLARGEBINS 32
+#define NBINS (NSMALLBINS + NLARGEBINS)
+
+// Filled in by heap_stats().
+typedef struct heap_stats_struct {
+    long heap_size;              // bytes between the heap start and the break
+    long in_use;                 // bytes in allocated blocks, headers included
+    long free_space;             // bytes in free blocks
+    long cached;                 // bytes in tcache fast bins
+    long peak_in_use;
+    long sbrk_bytes;             // bytes ever obtained through sbrk()
+    long largest_free_chunk;
+    long large_bytes;            // bytes mapped for large objects
+    int large_allocs;            // live large objects
+    int num_allocs;
+    int free_blocks[NBINS];      // free blocks per size class
+} heap_stats_struct;
+
+void heap_stats(heap_stats_struct* stats);
+
+#endif
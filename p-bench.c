@@ -0,0 +1,229 @@
+#include "process.h"
+#include "lib.h"
+#include "malloc.h"
+#include "syscall.h"
+
+// p-bench
+//
+//    A fixed set of allocator benchmarks, run with the "bench" boot command.
+//    Every run uses the same seeds and sizes, so its numbers can be compared
+//    against a baseline taken before an allocator change. Each benchmark
+//    prints its operation count, cycles per operation, operations per
+//    second, the peak bytes in use so far (from heap_stats()) and the
+//    fragmentation it left.
+
+// Nominal TSC rate used to turn cycles into operations per second. Pass
+// -DBENCH_TSC_MHZ=... to match the machine the numbers come from.
+#ifndef BENCH_TSC_MHZ
+#define BENCH_TSC_MHZ 2000
+#endif
+
+#define BENCH_SLOTS 512                 // live objects per benchmark
+#define BENCH_ROUNDS 20000              // operations per benchmark
+#define BENCH_NWORKERS 3                // forked processes in "fifo-procs"
+#define BENCH_WAIT_YIELDS 1000000       // give up on workers after this
+
+static void* slots[BENCH_SLOTS];
+static uint64_t seed;
+
+// bench_rand()
+//    xorshift64; deterministic so every run sees the same request stream.
+static uint64_t bench_rand(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+// bench_fragmentation()
+//    Return the heap's fragmentation in percent: the share of free space
+//    that is not in the largest free block. 0 means all free space is in one
+//    block (or there is none).
+static int bench_fragmentation(void) {
+    heap_info_struct info;
+    if (heap_info(&info) < 0 || info.free_space <= 0) {
+        return 0;
+    }
+    return 100 - (int) ((100 * (long) info.largest_free_chunk)
+                        / info.free_space);
+}
+
+// bench_report(name, ops, cycles)
+//    Print one result line.
+static void bench_report(const char* name, long ops, uint64_t cycles) {
+    heap_stats_struct stats;
+    heap_stats(&stats);
+    uint64_t per_op = ops ? cycles / ops : 0;
+    uint64_t ops_per_sec = cycles
+        ? (uint64_t) ops * BENCH_TSC_MHZ * 1000000 / cycles : 0;
+    app_printf(0, "%-10s %6ld ops %6lu cyc/op %9lu ops/s peak %6luK frag %d%%\n",
+               name, ops, per_op, ops_per_sec,
+               stats.peak_in_use / 1024, bench_fragmentation());
+}
+
+// bench_reset(s)
+//    Free every live slot and restart the request stream from seed `s`.
+static void bench_reset(uint64_t s) {
+    for (int i = 0; i < BENCH_SLOTS; i++) {
+        free(slots[i]);
+        slots[i] = NULL;
+    }
+    seed = s;
+}
+
+// bench_churn()
+//    Fixed-size allocate/free in random slots: the allocator's fast path.
+static void bench_churn(void) {
+    bench_reset(1);
+    uint64_t start = perf_rdtsc();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        int i = bench_rand() % BENCH_SLOTS;
+        if (slots[i]) {
+            free(slots[i]);
+            slots[i] = NULL;
+        } else {
+            slots[i] = malloc(64);
+        }
+    }
+    bench_report("churn", BENCH_ROUNDS, perf_rdtsc() - start);
+}
+
+// bench_mix()
+//    Random sizes, mostly small with an occasional large block.
+static void bench_mix(void) {
+    bench_reset(2);
+    uint64_t start = perf_rdtsc();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        int i = bench_rand() % BENCH_SLOTS;
+        free(slots[i]);
+        uint64_t x = bench_rand();
+        size_t sz = (x & 15) ? 8 + x % 256 : 256 + x % 8192;
+        slots[i] = malloc(sz);
+    }
+    bench_report("mix", BENCH_ROUNDS, perf_rdtsc() - start);
+}
+
+// bench_realloc()
+//    Grow blocks a little at a time, as a dynamic array would.
+static void bench_realloc(void) {
+    bench_reset(3);
+    long ops = 0;
+    uint64_t start = perf_rdtsc();
+    for (int i = 0; i < BENCH_SLOTS && ops < BENCH_ROUNDS; i++) {
+        for (size_t sz = 16; sz <= 4096 && ops < BENCH_ROUNDS; sz += 16 + sz / 4) {
+            void* ptr = realloc(slots[i], sz);
+            if (!ptr) {
+                break;
+            }
+            slots[i] = ptr;
+            ops++;
+        }
+    }
+    bench_report("realloc", ops, perf_rdtsc() - start);
+}
+
+// bench_fifo_run(name)
+//    A producer fills a FIFO queue with messages in bursts and a consumer
+//    frees them in arrival order at a steady rate, so blocks are freed far
+//    from where allocation is happening.
+static void bench_fifo_run(const char* name) {
+    int head = 0, tail = 0;
+    uint64_t start = perf_rdtsc();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        if (tail - head < BENCH_SLOTS && (bench_rand() & 3)) {
+            slots[tail++ % BENCH_SLOTS] = malloc(32 + bench_rand() % 480);
+        } else if (head < tail) {
+            free(slots[head % BENCH_SLOTS]);
+            slots[head++ % BENCH_SLOTS] = NULL;
+        }
+    }
+    bench_report(name, BENCH_ROUNDS, perf_rdtsc() - start);
+}
+
+static void bench_fifo(void) {
+    bench_reset(5);
+    bench_fifo_run("fifo");
+}
+
+// bench_fifo_procs()
+//    Run the FIFO pattern in BENCH_NWORKERS forked processes at once. Each
+//    worker has its own copy-on-write heap and reports its own line. The
+//    parent waits for them all to exit and reports the elapsed time for the
+//    whole batch. A worker has exited once sys_perf() no longer knows its
+//    pid.
+static void bench_fifo_procs(void) {
+    bench_reset(6);
+    pid_t workers[BENCH_NWORKERS];
+    int nworkers = 0;
+    uint64_t start = perf_rdtsc();
+    for (int w = 0; w < BENCH_NWORKERS; w++) {
+        pid_t p = sys_fork();
+        if (p == 0) {
+            seed = 6 + w;
+            bench_fifo_run("fifo-work");
+            sys_exit();
+        } else if (p > 0) {
+            workers[nworkers++] = p;
+        } else {
+            app_printf(0, "fifo-procs: fork failed\n");
+        }
+    }
+
+    perf_counters pc;
+    int running = nworkers;
+    for (long n = 0; running && n < BENCH_WAIT_YIELDS; n++) {
+        sys_yield();
+        running = 0;
+        for (int w = 0; w < nworkers; w++) {
+            running += sys_perf(&pc, workers[w]) >= 0;
+        }
+    }
+    if (running) {
+        app_printf(0, "fifo-procs: %d workers did not exit\n", running);
+    }
+    bench_report("fifo-procs", (long) nworkers * BENCH_ROUNDS,
+                 perf_rdtsc() - start);
+}
+
+// bench_fragment()
+//    Free every other block of a full heap, allocate larger blocks that do
+//    not fit the holes, then time defrag() on the result.
+static void bench_fragment(void) {
+    bench_reset(4);
+    uint64_t start = perf_rdtsc();
+    for (int i = 0; i < BENCH_SLOTS; i++) {
+        slots[i] = malloc(8 + bench_rand() % 120);
+    }
+    for (int i = 0; i < BENCH_SLOTS; i += 2) {
+        free(slots[i]);
+        slots[i] = malloc(256 + bench_rand() % 256);
+    }
+    for (int i = 1; i < BENCH_SLOTS; i += 4) {
+        free(slots[i]);
+        slots[i] = NULL;
+    }
+    bench_report("fragment", BENCH_SLOTS + BENCH_SLOTS / 2 + BENCH_SLOTS / 4,
+                 perf_rdtsc() - start);
+
+    start = perf_rdtsc();
+    defrag();
+    bench_report("defrag", 1, perf_rdtsc() - start);
+}
+
+void process_main(void) {
+    app_printf(0, "bench: %d rounds, %d slots, TSC %d MHz\n",
+               BENCH_ROUNDS, BENCH_SLOTS, BENCH_TSC_MHZ);
+
+    bench_churn();
+    bench_mix();
+    bench_realloc();
+    bench_fifo();
+    bench_fifo_procs();
+    bench_fragment();
+    bench_reset(0);
+
+    app_printf(0, "bench: done\n");
+    while (1) {
+        sys_yield();
+    }
+}
@@ -0,0 +1,56 @@
+#include "process.h"
+#include "lib.h"
+#include "syscall.h"
+
+// p-rangetest
+//
+//    Checks the argument validation of sys_page_alloc_range() and
+//    sys_page_free_range(), run with the "rangetest" boot command. Ranges
+//    that are misaligned, overlap the program or the stack, or start past
+//    the top of the address space must fail with -1 and leave every
+//    mapping alone; a valid range above the break must map and unmap.
+
+void process_main(void) {
+    uintptr_t brk = ROUNDUP((uintptr_t) sbrk(0), PAGESIZE);
+    uintptr_t top = ROUNDDOWN(read_rsp(), PAGESIZE);
+    char* page = (char*) (brk + 16 * PAGESIZE);
+
+    // Addresses beyond the virtual address space, including ones whose
+    // length check would wrap around
+    void* far[] = {
+        (void*) (top + PAGESIZE),
+        (void*) 0x1000000000000,
+        (void*) -PAGESIZE,
+        (void*) -(16 * PAGESIZE)
+    };
+    for (size_t i = 0; i < sizeof(far) / sizeof(far[0]); ++i) {
+        assert(sys_page_free_range(far[i], PAGESIZE) == -1);
+        assert(sys_page_alloc_range(far[i], PAGESIZE, PTE_W) == -1);
+    }
+
+    // Misaligned or inside the program or the stack page
+    assert(sys_page_free_range(page + 8, PAGESIZE) == -1);
+    assert(sys_page_free_range(page, PAGESIZE + 8) == -1);
+    assert(sys_page_free_range((void*) (brk - PAGESIZE), PAGESIZE) == -1);
+    assert(sys_page_free_range((void*) top, PAGESIZE) == -1);
+    assert(sys_page_alloc_range(page + 8, PAGESIZE, PTE_W) == -1);
+    assert(sys_page_alloc_range(page, PAGESIZE + 8, PTE_W) == -1);
+    assert(sys_page_alloc_range((void*) (brk - PAGESIZE), PAGESIZE, PTE_W)
+           == -1);
+    assert(sys_page_alloc_range((void*) (brk - PAGESIZE), PAGESIZE,
+                                PTE_W | PAGE_RANGE_LAZY) == -1);
+    assert(sys_page_alloc_range((void*) top, PAGESIZE, PTE_W) == -1);
+    assert(sys_page_alloc_range((void*) (top - PAGESIZE), 2 * PAGESIZE,
+                                PTE_W) == -1);
+
+    // A valid range
+    assert(sys_page_alloc_range(page, 2 * PAGESIZE, PTE_W) == 2);
+    memset(page, 1, 2 * PAGESIZE);
+    assert(sys_page_free_range(page, 2 * PAGESIZE) == 0);
+
+    // Still running, with our stack and code intact
+    app_printf(0, "rangetest: ok\n");
+    while (1) {
+        sys_yield();
+    }
+}
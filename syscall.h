@@ -0,0 +1,104 @@
+#ifndef WEENSYOS_SYSCALL_H
+#define WEENSYOS_SYSCALL_H
+#include "lib.h"
+
+// System calls beyond the ones lib.h defines, shared by the kernel and
+// user programs: their interrupt numbers, the data they exchange, and
+// user-side wrappers.
+
+#define INT_SYS_SETPRIORITY     58
+#define INT_SYS_FAULTAROUND     59
+#define INT_SYS_PAGE_ALLOC_RANGE 60
+#define INT_SYS_PERF            61
+#define INT_SYS_PAGE_FREE_RANGE 62
+
+#define PAGE_RANGE_LAZY 0x10000         // flag: map pages on first touch
+
+
+// PERFORMANCE COUNTERS
+//
+//    sys_perf(buf, pid) fills `*buf` with a snapshot of these counters:
+//    the whole system's if `pid` is 0, otherwise those of process `pid`.
+//    Cycle counts come from perf_rdtsc().
+
+#define PERF_NSYSCALLS 16               // INT_SYS .. INT_SYS + 15
+
+typedef struct perf_counters {
+    uint64_t syscalls[PERF_NSYSCALLS];  // by number - INT_SYS
+    uint64_t faults_handled;            // heap, lazy, COW, and load faults
+    uint64_t faults_fatal;              // faults that killed the process
+    uint64_t pages_allocated;
+    uint64_t pages_freed;
+    uint64_t context_switches;
+    uint64_t exception_cycles;          // total time in exception()
+    uint64_t check_cycles;              // check_virtual_memory() time
+    uint64_t memshow_cycles;            // memory viewer time
+} perf_counters;
+
+static inline uint64_t perf_rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+// sys_perf(buf, pid)
+//    Copy a counter snapshot to `buf`. Returns sizeof(perf_counters), or
+//    -1 for an invalid process or buffer.
+static inline long sys_perf(perf_counters* buf, pid_t pid) {
+    long result;
+    asm volatile ("int %1" : "=a" (result)
+                  : "i" (INT_SYS_PERF), "D" (buf), "S" ((long) pid)
+                  : "cc", "memory");
+    return result;
+}
+
+// sys_setpriority(pid, prio)
+//    Set the base scheduling priority of process `pid` (0 means the caller)
+//    to `prio`, from 0 (highest) to 3 (lowest). Returns 0, or -1 for an
+//    invalid process or priority.
+static inline int sys_setpriority(pid_t pid, int prio) {
+    long result;
+    asm volatile ("int %1" : "=a" (result)
+                  : "i" (INT_SYS_SETPRIORITY), "D" ((long) pid),
+                    "S" ((long) prio)
+                  : "cc", "memory");
+    return result;
+}
+
+// sys_faultaround(npages)
+//    Map up to `npages` heap pages per page fault in the caller (0 or 1
+//    turns fault-around off; the kernel caps large values). Returns the
+//    previous setting.
+static inline long sys_faultaround(unsigned npages) {
+    long result;
+    asm volatile ("int %1" : "=a" (result)
+                  : "i" (INT_SYS_FAULTAROUND), "D" ((long) npages)
+                  : "cc", "memory");
+    return result;
+}
+
+// sys_page_alloc_range(addr, len, flags)
+//    Map pages [addr, addr + len) in one system call. `flags` may hold
+//    PTE_W and PAGE_RANGE_LAZY. Returns the number of pages present from
+//    `addr` on, or -1 for a bad range.
+static inline long sys_page_alloc_range(void* addr, size_t len, int flags) {
+    long result;
+    asm volatile ("int %1" : "=a" (result)
+                  : "i" (INT_SYS_PAGE_ALLOC_RANGE), "D" (addr), "S" (len),
+                    "d" (flags)
+                  : "cc", "memory");
+    return result;
+}
+
+// sys_page_free_range(addr, len)
+//    Unmap pages [addr, addr + len) and give them back to the kernel.
+//    Returns 0, or -1 for a bad range.
+static inline int sys_page_free_range(void* addr, size_t len) {
+    long result;
+    asm volatile ("int %1" : "=a" (result)
+                  : "i" (INT_SYS_PAGE_FREE_RANGE), "D" (addr), "S" (len)
+                  : "cc", "memory");
+    return result;
+}
+
+#endif